@@ -0,0 +1,489 @@
+#include "FileTypes.hpp"
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <boost/endian/buffers.hpp>
+
+#include "Config.hpp"
+#include "MappedFile.hpp"
+#include "Utilities.hpp"
+
+ProcessFunction processFunctionFor(uint32_t magic) {
+	switch (magic) {
+		case 'PIC4': return processPic;
+		case 'BUP4': return processBup;
+		case 'TXA4': return processTxa;
+		case 'MSK3': return processMsk3;
+		case 'MSK4': return processMsk4;
+	}
+	return nullptr;
+}
+
+namespace {
+
+static const char *MANIFEST_MAGIC = "EnterExtractor manifest 1";
+
+/// What a manifest remembers about one input file
+struct ManifestEntry {
+	uintmax_t size = 0;
+	int64_t mtime = 0;
+	/// Empty if the last conversion failed, so the file is always retried
+	std::string hash;
+	/// Relative to the output directory
+	std::vector<std::string> outputs;
+};
+
+/// Records what each input produced last time, keyed by input path relative to the input directory
+/// Format is line based, `file\tpath\tsize\tmtime\thash` followed by an `out\tpath` line per output
+struct Manifest {
+	std::string options;
+	std::unordered_map<std::string, ManifestEntry> entries;
+
+	/// Leaves the manifest empty if the file doesn't exist, was written by a different version or is corrupt
+	void read(const fs::path &path) {
+		fs::ifstream in(path, std::ios::binary);
+		std::string line;
+		if (!std::getline(in, line) || line != MANIFEST_MAGIC) { return; }
+		ManifestEntry *current = nullptr;
+		try {
+			while (std::getline(in, line)) {
+				std::vector<std::string> fields;
+				std::stringstream ss(line);
+				std::string field;
+				while (std::getline(ss, field, '\t')) { fields.push_back(field); }
+				if (fields.size() == 2 && fields[0] == "options") {
+					options = fields[1];
+				} else if (fields.size() >= 4 && fields[0] == "file") {
+					current = &entries[fields[1]];
+					size_t sizeEnd, mtimeEnd;
+					current->size = std::stoull(fields[2], &sizeEnd);
+					current->mtime = std::stoll(fields[3], &mtimeEnd);
+					if (sizeEnd != fields[2].size() || mtimeEnd != fields[3].size()) {
+						throw std::invalid_argument("Trailing characters in " + line);
+					}
+					current->hash = fields.size() > 4 ? fields[4] : "";
+				} else if (fields.size() == 2 && fields[0] == "out" && current) {
+					current->outputs.push_back(fields[1]);
+				}
+			}
+		} catch (std::exception &e) {
+			// Anything left half read can't be trusted, so convert everything again
+			std::cerr << "Ignoring corrupt manifest " << path.string() << ": " << e.what() << std::endl;
+			options.clear();
+			entries.clear();
+		}
+	}
+
+	void write(const fs::path &path) const {
+		std::vector<const std::pair<const std::string, ManifestEntry> *> sorted;
+		for (const auto &entry : entries) { sorted.push_back(&entry); }
+		std::sort(sorted.begin(), sorted.end(), [](const auto *a, const auto *b){ return a->first < b->first; });
+
+		// Write next to the real manifest first so an interrupted run can't leave a truncated one behind
+		fs::path tmp = path;
+		tmp += ".tmp";
+		{
+			fs::ofstream out(tmp, std::ios::binary);
+			out << MANIFEST_MAGIC << "\n";
+			out << "options\t" << options << "\n";
+			for (const auto *entry : sorted) {
+				out << "file\t" << entry->first << "\t" << entry->second.size << "\t" << entry->second.mtime << "\t" << entry->second.hash << "\n";
+				for (const auto &output : entry->second.outputs) {
+					out << "out\t" << output << "\n";
+				}
+			}
+			if (!out) { throw std::runtime_error("Failed to write manifest " + tmp.string()); }
+		}
+		fs::rename(tmp, path);
+	}
+};
+
+/// Everything that changes what a conversion outputs, a manifest written with other options is ignored
+std::string outputOptions(const ConversionContext &options) {
+	std::string out = "parts=" + std::to_string(options.saveBupAsParts) + " thumbnail=" + std::to_string(options.thumbnailSize) + " only=";
+	for (const auto &name : options.onlyNames) {
+		out += name + ",";
+	}
+	return out;
+}
+
+int64_t modificationTime(const fs::path &path) {
+#if USE_BOOST_FS
+	return fs::last_write_time(path);
+#else
+	return fs::last_write_time(path).time_since_epoch().count();
+#endif
+}
+
+/// 64-bit FNV-1a
+uint64_t fnv1a(const uint8_t *data, size_t size) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 0x100000001b3;
+	}
+	return hash;
+}
+
+std::string hashBytes(ByteSpan data) {
+	uint64_t hash = fnv1a(data.data(), data.size());
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash);
+	return buf;
+}
+
+/// Which shard a file belongs to, from its path relative to the input directory
+/// Depends on nothing else, so files never move between shards as the tree changes and one shard's manifest never claims another's outputs
+uint32_t shardOf(const std::string &relative, uint32_t shardCount) {
+	return fnv1a(reinterpret_cast<const uint8_t *>(relative.data()), relative.size()) % shardCount;
+}
+
+enum class BatchResult {
+	Converted,
+	UpToDate,
+	Skipped,
+	Failed,
+};
+
+/// One input file on its way through the pipeline
+struct BatchFile {
+	fs::path path;
+	std::string relative;
+	uintmax_t size;
+	int64_t mtime;
+	/// This file's manifest entry from the last run if it had one, and the one being filled in for the next run, both null without a manifest
+	const ManifestEntry *previous = nullptr;
+	ManifestEntry *entry = nullptr;
+	/// Mapped by the read stage and released by the decode stage
+	std::unique_ptr<MappedFile> mapped;
+	BatchResult result = BatchResult::Failed;
+	std::string error;
+	/// Another input writes the outputs this one would, so it's failed without being read
+	bool conflict = false;
+};
+
+bool outputsExist(const fs::path &outputDir, const ManifestEntry &entry) {
+	return std::all_of(entry.outputs.begin(), entry.outputs.end(), [&](const std::string &output){ return fs::exists(outputDir/fs::u8path(output)); });
+}
+
+ProcessFunction processFunctionFor(ByteSpan in) {
+	if (in.size() < 4) { return nullptr; }
+	boost::endian::big_int32_buf_t magic;
+	memcpy(&magic, in.data(), 4);
+	return ::processFunctionFor(magic.value());
+}
+
+/// Read stage: maps the file and brings it into memory so the decode stage doesn't wait on the disk
+/// Returns whether the file still needs decoding, if not `file.result` says why
+bool readOne(const fs::path &outputDir, BatchFile &file) {
+	file.mapped = std::make_unique<MappedFile>(file.path);
+	ByteSpan in = file.mapped->data();
+	if (file.entry) {
+		file.entry->size = file.size;
+		file.entry->mtime = file.mtime;
+		// Reads the whole file anyway
+		file.entry->hash = hashBytes(in);
+		// Touched but unchanged
+		if (file.previous && file.previous->hash == file.entry->hash && outputsExist(outputDir, *file.previous)) {
+			file.entry->outputs = file.previous->outputs;
+			file.result = BatchResult::UpToDate;
+			return false;
+		}
+	}
+	if (!processFunctionFor(in)) {
+		file.result = BatchResult::Skipped;
+		return false;
+	}
+	if (!file.entry) {
+		file.mapped->prefetch();
+	}
+	return true;
+}
+
+/// Decode stage: decompresses and composites the file, handing its images to the encode stage
+void decodeOne(const ConversionContext &options, const fs::path &outputDir, BatchFile &file, OutputRecorder &recorder) {
+	ConversionContext ctx = options;
+	ctx.fileName = file.path;
+	ctx.recorder = &recorder;
+	ByteSpan in = file.mapped->data();
+	ProcessFunction process = processFunctionFor(in);
+
+	fs::path output = outputDir/fs::u8path(file.relative);
+	output.replace_extension(".png");
+	fs::create_directories(output.parent_path());
+
+	int res = process(ctx, in, output);
+	if (res != 0) {
+		file.error = "exited with code " + std::to_string(res);
+		file.result = BatchResult::Failed;
+		return;
+	}
+	file.result = BatchResult::Converted;
+}
+
+/// Once every image is saved, checks whether any failed and fills in the file's manifest entry
+void finishOne(const fs::path &outputDir, BatchFile &file, OutputRecorder &recorder) {
+	if (file.result == BatchResult::Converted && recorder.failed()) {
+		file.result = BatchResult::Failed;
+		file.error = "failed to save an output";
+	}
+	if (!file.entry || file.result == BatchResult::UpToDate) { return; }
+	for (const auto &path : recorder.take()) {
+		// Debug images go elsewhere and aren't tracked
+		std::string relative = fs::relative(path, outputDir).generic_string();
+		if (relative.compare(0, 2, "..") != 0) {
+			file.entry->outputs.push_back(std::move(relative));
+		}
+	}
+	std::sort(file.entry->outputs.begin(), file.entry->outputs.end());
+	file.entry->outputs.erase(std::unique(file.entry->outputs.begin(), file.entry->outputs.end()), file.entry->outputs.end());
+	if (file.result == BatchResult::Failed) {
+		file.entry->hash.clear();
+	}
+}
+
+/// Deletes the outputs in `old` that aren't in `current` or claimed by any input in `claimed`, returning how many were deleted
+size_t removeStale(const fs::path &outputDir, const std::vector<std::string> &old, const std::vector<std::string> *current, const std::unordered_set<std::string> &claimed) {
+	size_t removed = 0;
+	for (const auto &output : old) {
+		if (current && std::find(current->begin(), current->end(), output) != current->end()) { continue; }
+		if (claimed.count(output)) { continue; }
+		if (fs::remove(outputDir/fs::u8path(output))) { removed++; }
+	}
+	return removed;
+}
+
+/// Whether the file starts with the magic of a supported type, without reading the rest
+bool isSupported(const fs::path &path) {
+	fs::ifstream in(path, std::ios::binary);
+	uint8_t magic[4];
+	if (!in.read(reinterpret_cast<char *>(magic), sizeof(magic))) { return false; }
+	return processFunctionFor(ByteSpan(magic, sizeof(magic))) != nullptr;
+}
+
+/// Inputs in the same folder that differ only by extension (e.g. foo.pic and foo.msk) would write the same outputs
+/// The first supported one in path order keeps them, returns the relative paths of the others mapped to that one
+/// Every file in the tree is checked (not just one shard's), so every shard agrees on the result
+std::unordered_map<std::string, std::string> findOutputConflicts(const fs::path &input, const std::vector<fs::path> &paths) {
+	std::unordered_map<std::string, std::vector<std::string>> byOutput;
+	for (const auto &path : paths) {
+		std::string relative = fs::relative(path, input).generic_string();
+		byOutput[fs::path(relative).replace_extension().generic_string()].push_back(std::move(relative));
+	}
+	std::unordered_map<std::string, std::string> conflicts;
+	for (auto &group : byOutput) {
+		if (group.second.size() < 2) { continue; }
+		std::sort(group.second.begin(), group.second.end());
+		const std::string *owner = nullptr;
+		for (const auto &relative : group.second) {
+			if (!isSupported(input/fs::u8path(relative))) { continue; }
+			if (owner) {
+				conflicts[relative] = *owner;
+			} else {
+				owner = &relative;
+			}
+		}
+	}
+	return conflicts;
+}
+
+}
+
+int processDirectory(const ConversionContext &options, const fs::path &input, const fs::path &output, const fs::path &manifestPath, uint32_t shard, uint32_t shardCount) {
+	bool useManifest = !manifestPath.empty();
+	Manifest previous;
+	if (useManifest) {
+		previous.read(manifestPath);
+		if (previous.options != outputOptions(options)) {
+			// Outputs were made with different options, nothing can be reused but everything is still cleaned up
+			for (auto &entry : previous.entries) { entry.second.hash.clear(); }
+		}
+	}
+	Manifest next;
+	next.options = outputOptions(options);
+
+	std::vector<BatchFile> files;
+	/// Inputs that belong to other shards, whose outputs aren't ours to remove
+	std::unordered_set<std::string> otherShards;
+	size_t upToDate = 0;
+	std::vector<fs::path> paths;
+	for (const auto &entry : fs::recursive_directory_iterator(input)) {
+		if (!fs::is_regular_file(entry.status())) { continue; }
+		const fs::path &path = entry.path();
+		if (useManifest && fs::exists(manifestPath) && fs::equivalent(path, manifestPath)) { continue; }
+		paths.push_back(path);
+	}
+	auto conflicts = findOutputConflicts(input, paths);
+	for (const auto &path : paths) {
+		BatchFile file;
+		file.path = path;
+		file.relative = fs::relative(path, input).generic_string();
+		if (shardOf(file.relative, shardCount) != shard) {
+			if (useManifest) { otherShards.insert(std::move(file.relative)); }
+			continue;
+		}
+		file.size = fs::file_size(path);
+		file.mtime = modificationTime(path);
+		auto conflict = conflicts.find(file.relative);
+		if (conflict != conflicts.end()) {
+			file.error = "has the same output name as " + conflict->second + ", not converting";
+			file.conflict = true;
+		}
+		if (useManifest) {
+			auto found = previous.entries.find(file.relative);
+			if (!file.conflict && found != previous.entries.end() && !found->second.hash.empty() && found->second.size == file.size && found->second.mtime == file.mtime && outputsExist(output, found->second)) {
+				next.entries[file.relative] = found->second;
+				upToDate++;
+				continue;
+			}
+			next.entries[file.relative];
+		}
+		files.push_back(std::move(file));
+	}
+	// Start the biggest files first so one large file doesn't end up running alone at the end
+	std::stable_sort(files.begin(), files.end(), [](const BatchFile &a, const BatchFile &b){ return a.size > b.size; });
+
+	if (useManifest) {
+		// Both maps were fully populated above, so these pointers stay valid and lookups from the stages don't race
+		for (auto &file : files) {
+			auto found = previous.entries.find(file.relative);
+			file.previous = found != previous.entries.end() ? &found->second : nullptr;
+			file.entry = &next.entries.find(file.relative)->second;
+		}
+	}
+
+	std::vector<OutputRecorder> recorders(files.size());
+	auto read = [&](size_t i) {
+		bool needsDecode = false;
+		if (files[i].conflict) { return false; }
+		try {
+			needsDecode = readOne(output, files[i]);
+		} catch (std::exception &e) {
+			files[i].result = BatchResult::Failed;
+			files[i].error = e.what();
+		}
+		// Files that won't be decoded are done with their mapping, rather than holding it until the batch ends
+		if (!needsDecode) {
+			files[i].mapped.reset();
+		}
+		return needsDecode;
+	};
+	auto decode = [&](size_t i) {
+		try {
+			decodeOne(options, output, files[i], recorders[i]);
+		} catch (std::exception &e) {
+			files[i].result = BatchResult::Failed;
+			files[i].error = e.what();
+		}
+		files[i].mapped.reset();
+	};
+#if ENABLE_MULTITHREADED
+	// Read -> decode -> encode, with each stage on the shared pool so one can run ahead while another is busy
+	// Files read but not yet decoded are bounded so the read stage can't get arbitrarily far ahead
+	size_t decodeThreads = DECODE_THREADS > 0 ? DECODE_THREADS : threadCount();
+	size_t maxReadAhead = 2 * decodeThreads;
+	std::mutex mtx;
+	std::condition_variable cv;
+	size_t inFlight = 0;
+	auto finished = [&]{
+		{
+			std::lock_guard<std::mutex> l(mtx);
+			inFlight--;
+		}
+		cv.notify_all();
+	};
+	{
+		TaskGroup decodeStage(DECODE_THREADS > 0 ? DECODE_THREADS : SIZE_MAX);
+		TaskGroup readStage(READ_THREADS > 0 ? READ_THREADS : 2);
+		for (size_t i = 0; i < files.size(); i++) {
+			{
+				std::unique_lock<std::mutex> l(mtx);
+				while (inFlight >= maxReadAhead) {
+					l.unlock();
+					// Help the later stage along rather than sit idle
+					bool ran = decodeStage.runPending();
+					l.lock();
+					if (!ran) {
+						cv.wait(l, [&]{ return inFlight < maxReadAhead; });
+					}
+				}
+				inFlight++;
+			}
+			readStage.run([&, i]{
+				if (read(i)) {
+					decodeStage.run([&, i]{
+						decode(i);
+						finished();
+					});
+				} else {
+					finished();
+				}
+			});
+		}
+		readStage.wait();
+		decodeStage.wait();
+	}
+	ThreadedImageSaver::shared().wait(options.printStats);
+#else
+	for (size_t i = 0; i < files.size(); i++) {
+		if (read(i)) {
+			decode(i);
+		}
+	}
+#endif
+	for (size_t i = 0; i < files.size(); i++) {
+		finishOne(output, files[i], recorders[i]);
+		if (files[i].result == BatchResult::Failed) {
+			std::cerr << files[i].path.string() << ": " << files[i].error << std::endl;
+		}
+	}
+
+	size_t removed = 0;
+	if (useManifest) {
+		// An output can move to a different input (when its old one is deleted and another one with the same name takes over), so never delete one that's still produced
+		std::unordered_set<std::string> claimed;
+		for (const auto &entry : next.entries) {
+			claimed.insert(entry.second.outputs.begin(), entry.second.outputs.end());
+		}
+		for (auto &old : previous.entries) {
+			auto found = next.entries.find(old.first);
+			if (found == next.entries.end()) {
+				// Moved to another shard (the shard count changed), that shard's run takes care of it now
+				if (otherShards.count(old.first)) { continue; }
+				removed += removeStale(output, old.second.outputs, nullptr, claimed);
+			} else if (found->second.hash.empty()) {
+				// Failed, keep tracking the old outputs so a later successful run can clean them up
+				auto &outputs = found->second.outputs;
+				for (const auto &path : old.second.outputs) {
+					if (std::find(outputs.begin(), outputs.end(), path) == outputs.end()) { outputs.push_back(path); }
+				}
+			} else {
+				removed += removeStale(output, old.second.outputs, &found->second.outputs, claimed);
+			}
+		}
+		next.write(manifestPath);
+	}
+
+	auto count = [&](BatchResult result) {
+		return std::count_if(files.begin(), files.end(), [&](const BatchFile &file){ return file.result == result; });
+	};
+	upToDate += count(BatchResult::UpToDate);
+	size_t converted = count(BatchResult::Converted);
+	size_t failed = count(BatchResult::Failed);
+	size_t skipped = count(BatchResult::Skipped);
+	std::cout << "Converted " << converted << " files, " << failed << " failed, " << skipped << " skipped";
+	if (useManifest) {
+		std::cout << ", " << upToDate << " up to date, removed " << removed << " stale outputs";
+	}
+	std::cout << std::endl;
+	return failed ? EXIT_FAILURE : 0;
+}
@@ -1,6 +1,8 @@
 #include "FileTypes.hpp"
 
 #include <stdint.h>
+#include <exception>
+#include <unordered_map>
 
 #include "BupOutputters.hpp"
 #include "Config.hpp"
@@ -8,55 +10,210 @@
 #include "HeaderStructs.hpp"
 #include "Decompression.hpp"
 #include "Image.hpp"
+#include "Utilities.hpp"
+
+namespace {
+
+struct DecodedChunk {
+	Image image;
+	std::vector<MaskRect> masks;
+	Point pos = {0, 0};
+};
+
+/// Decodes the chunks of a BUP in the order they were added
+/// With multithreading enabled, decoding happens on the thread pool while the caller composites earlier chunks
+/// Chunks are keyed by offset, so ones shared by multiple expressions (e.g. mouth sets) are only decoded once
+class BupChunkDecoder {
+	struct Job {
+		uint32_t offset;
+		std::string name;
+		DecodedChunk result;
+		std::exception_ptr error;
+		/// Set once a thread starts decoding the job
+		bool claimed = false;
+		bool ready = false;
+		/// Number of `add`s not yet matched by a `release`
+		int refs = 0;
+		Job(uint32_t offset, std::string name): offset(offset), name(std::move(name)) {}
+	};
+
+	const ConversionContext &ctx;
+	ByteSpan file;
+	bool isSwitch;
+	std::vector<Job> jobs;
+	std::unordered_map<uint32_t, size_t> jobsByOffset;
+	size_t lookups = 0;
+#if ENABLE_MULTITHREADED
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::atomic<bool> cancelled{false};
+	/// Last so that it's destroyed (and waits for its tasks) first
+	TaskGroup tasks;
+
+	/// Decodes the job unless another thread already started on it
+	void tryDecode(Job &job) {
+		{
+			std::lock_guard<std::mutex> l(mtx);
+			if (job.claimed) { return; }
+			job.claimed = true;
+		}
+		if (!cancelled) {
+			decode(job);
+		}
+		{
+			std::lock_guard<std::mutex> l(mtx);
+			job.ready = true;
+		}
+		cv.notify_all();
+	}
+#endif
+
+	void decode(Job &job) {
+		try {
+			job.result.pos = processChunk(ctx, job.result.image, job.result.masks, job.offset, file, job.name, isSwitch);
+		} catch (...) {
+			job.error = std::current_exception();
+		}
+	}
+
+public:
+	static constexpr size_t NONE = SIZE_MAX;
+
+	BupChunkDecoder(const ConversionContext &ctx, ByteSpan file, bool isSwitch): ctx(ctx), file(file), isSwitch(isSwitch) {}
+	~BupChunkDecoder() {
+#if ENABLE_MULTITHREADED
+		cancelled = true;
+		tasks.wait();
+#endif
+	}
+
+	/// Must not be called after `start`
+	size_t add(uint32_t offset, std::string name) {
+		lookups++;
+		auto found = jobsByOffset.find(offset);
+		if (found != jobsByOffset.end()) {
+			jobs[found->second].refs++;
+			return found->second;
+		}
+		jobs.emplace_back(offset, std::move(name));
+		jobs.back().refs = 1;
+		jobsByOffset[offset] = jobs.size() - 1;
+		return jobs.size() - 1;
+	}
+
+	size_t uniqueChunks() const { return jobs.size(); }
+	size_t cacheHits() const { return lookups - jobs.size(); }
+	size_t cacheLookups() const { return lookups; }
+
+	void start() {
+#if ENABLE_MULTITHREADED
+		// The group starts its tasks oldest first whichever pool thread runs them (even the submitting one, which takes its own pool tasks newest first), so jobs decode roughly in the order they're needed
+		for (auto &job : jobs) {
+			tasks.run([this, &job]{ tryDecode(job); });
+		}
+#endif
+	}
+
+	/// Waits for the given chunk to finish decoding, rethrowing any error it hit
+	const DecodedChunk &get(size_t idx) {
+		Job &job = jobs[idx];
+#if ENABLE_MULTITHREADED
+		// Rather than wait for the pool to get to it, decode it here if nothing has started on it yet
+		tryDecode(job);
+		std::unique_lock<std::mutex> l(mtx);
+		cv.wait(l, [&]{ return job.ready; });
+#else
+		if (!job.ready) {
+			decode(job);
+			job.ready = true;
+		}
+#endif
+		if (job.error) {
+			std::rethrow_exception(job.error);
+		}
+		return job.result;
+	}
 
-int processBup(std::istream &in, const fs::path &output) {
+	/// Call once per `add`, frees the decoded chunk once nothing else will use it
+	void release(size_t idx) {
+		if (--jobs[idx].refs == 0) {
+			jobs[idx].result = DecodedChunk();
+		}
+	}
+};
+
+}
+
+int processBup(const ConversionContext &ctx, ByteSpan in, const fs::path &output) {
 	fs::path outputDir = output.parent_path();
 	std::string outTemplate = output.stem().string();
 
-	std::unique_ptr<BupOutputter> out = SAVE_BUP_AS_PARTS ? BupOutputter::makeParts() : BupOutputter::makeComposited();
+	std::unique_ptr<BupOutputter> out = ctx.saveBupAsParts ? BupOutputter::makeParts(ctx) : BupOutputter::makeComposited(ctx);
 
+	SpanReader reader(ctx, in);
 	BupHeader header;
-	in >> header;
-
-	Image base({header.width, header.height}), currentChunk({0, 0});
-	std::vector<MaskRect> maskData;
+	reader >> header;
 
+	// Queue every chunk up front so later expressions decode while earlier ones are composited
+	BupChunkDecoder decoder(ctx, in, header.isSwitch);
+	std::vector<size_t> baseJobs;
 	for (const auto& chunk : header.chunks) {
 		size_t i = &chunk - &header.chunks[0];
+		baseJobs.push_back(decoder.add(chunk.offset, outTemplate + "_BaseChunk" + std::to_string(i)));
+	}
+	std::vector<size_t> selected;
+	for (size_t e = 0; e < header.expChunks.size(); e++) {
+		if (ctx.isNameSelected(header.expChunks[e].name)) { selected.push_back(e); }
+	}
+	if (selected.empty() && !ctx.onlyNames.empty()) {
+		std::cerr << ctx.fileName.string() << ": no expressions matched the names given to -only" << std::endl;
+	}
+	std::vector<size_t> faceJobs;
+	std::vector<std::vector<size_t>> mouthJobs;
+	for (size_t e : selected) {
+		const auto& expChunk = header.expChunks[e];
+		faceJobs.push_back(expChunk.face.offset ? decoder.add(expChunk.face.offset, outTemplate + "_" + expChunk.name + "_Face") : BupChunkDecoder::NONE);
+		mouthJobs.emplace_back();
+		for (int i = 0; i < expChunk.mouths.size(); i++) {
+			const auto& mouth = expChunk.mouths[i];
+			mouthJobs.back().push_back(mouth.offset ? decoder.add(mouth.offset, outTemplate + "_" + expChunk.name + "_Mouth" + std::to_string(i)) : BupChunkDecoder::NONE);
+		}
+	}
+	decoder.start();
 
-		Point pos = processChunk(currentChunk, maskData, chunk.offset, in, outTemplate + "_BaseChunk" + std::to_string(i), header.isSwitch);
+	Image base({header.width, header.height});
 
-		currentChunk.drawOnto(base, pos, maskData);
+	for (size_t job : baseJobs) {
+		const DecodedChunk &chunk = decoder.get(job);
+		chunk.image.drawOnto(base, chunk.pos, chunk.masks);
+		decoder.release(job);
 	}
-	if (SHOULD_WRITE_DEBUG_IMAGES) {
-		base.writePNG(debugImagePath/(outTemplate + "_Base.png"));
+	if (ctx.writeDebugImages()) {
+		base.writePNG(ctx.debugImagePath/(outTemplate + "_Base.png"));
 	}
 
 	out->setBase(outputDir, std::move(base), outTemplate);
 
-	Image withEyes({0, 0});
-
-	for (const auto& expChunk : header.expChunks) {
-		withEyes = base;
-
-		if (expChunk.face.offset) {
-			Point facePos = processChunk(currentChunk, maskData, expChunk.face.offset, in, outTemplate + "_" + expChunk.name + "_Face", header.isSwitch);
-			out->newFace(currentChunk, facePos, expChunk.name, maskData);
+	for (size_t s = 0; s < selected.size(); s++) {
+		const auto& expChunk = header.expChunks[selected[s]];
+		if (faceJobs[s] != BupChunkDecoder::NONE) {
+			const DecodedChunk &face = decoder.get(faceJobs[s]);
+			out->newFace(face.image, face.pos, expChunk.name, face.masks);
+			decoder.release(faceJobs[s]);
 		} else {
 			out->newFace(Image(), {0, 0}, "", {});
 		}
 
 		bool atLeastOneMouth = false;
-		for (int i = 0; i < expChunk.mouths.size(); i++) {
-			const auto& mouth = expChunk.mouths[i];
+		for (int i = 0; i < mouthJobs[s].size(); i++) {
+			size_t job = mouthJobs[s][i];
 
-			if (!mouth.offset) { continue; }
+			if (job == BupChunkDecoder::NONE) { continue; }
 			atLeastOneMouth = true;
 
-			Image withMouth = withEyes;
-
-			Point mouthPos = processChunk(currentChunk, maskData, mouth.offset, in, outTemplate + "_" + expChunk.name + "_Mouth" + std::to_string(i), header.isSwitch);
-			out->newMouth(currentChunk, mouthPos, i, maskData);
+			const DecodedChunk &mouth = decoder.get(job);
+			out->newMouth(mouth.image, mouth.pos, i, mouth.masks);
+			decoder.release(job);
 			out->write();
 		}
 		if (!atLeastOneMouth) {
@@ -64,5 +221,11 @@ int processBup(std::istream &in, const fs::path &output) {
 		}
 	}
 
+	if (ctx.printStats) {
+		size_t lookups = decoder.cacheLookups();
+		std::cout << ctx.fileName.string() << ": decoded " << decoder.uniqueChunks() << " unique chunks for " << lookups << " references, chunk cache hit rate "
+		          << (lookups ? 100 * decoder.cacheHits() / lookups : 0) << "%" << std::endl;
+	}
+
 	return 0;
 }
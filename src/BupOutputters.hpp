@@ -1,14 +1,18 @@
 #pragma once
 
+#include "Config.hpp"
 #include "FS.hpp"
 #include "Image.hpp"
 
 class BupOutputter {
+protected:
+	/// The conversion being output, must outlive the outputter
+	const ConversionContext &ctx;
 public:
-	static std::unique_ptr<BupOutputter> makeComposited();
-	static std::unique_ptr<BupOutputter> makeParts();
+	static std::unique_ptr<BupOutputter> makeComposited(const ConversionContext &ctx);
+	static std::unique_ptr<BupOutputter> makeParts(const ConversionContext &ctx);
 
-	BupOutputter() {}
+	BupOutputter(const ConversionContext &ctx): ctx(ctx) {}
 	virtual ~BupOutputter() {}
 	virtual void setBase(fs::path basePath, Image img, std::string name) = 0;
 	virtual void newFace(const Image& img, Point pos, const std::string& name, const std::vector<MaskRect>& mask) = 0;
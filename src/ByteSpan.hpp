@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+/// Bounds-checked view of bytes owned by something else, usually a MappedFile
+class ByteSpan {
+	const uint8_t *ptr = nullptr;
+	size_t len = 0;
+
+public:
+	ByteSpan() = default;
+	ByteSpan(const uint8_t *data, size_t size): ptr(data), len(size) {}
+
+	const uint8_t *data() const { return ptr; }
+	size_t size() const { return len; }
+	bool empty() const { return len == 0; }
+
+	/// Throws if `[offset, offset + length)` isn't inside the span
+	ByteSpan subspan(size_t offset, size_t length) const {
+		if (offset > len || length > len - offset) {
+			throw std::runtime_error("Tried to read " + std::to_string(length) + " bytes at offset " + std::to_string(offset) + " of a " + std::to_string(len) + " byte file");
+		}
+		return ByteSpan(ptr + offset, length);
+	}
+
+	ByteSpan subspan(size_t offset) const {
+		return subspan(offset, offset <= len ? len - offset : 0);
+	}
+};
+
+struct ConversionContext;
+
+/// Tells the context's RegionChecker (if -coverage was given) that the decoder used these bytes
+void recordCoverage(const ConversionContext *context, ByteSpan span);
+
+/// Reads values one after another out of a ByteSpan, throwing instead of running off the end
+class SpanReader {
+	ByteSpan span;
+	size_t pos;
+	const ConversionContext *ctx = nullptr;
+
+public:
+	SpanReader(ByteSpan span, size_t pos = 0): span(span), pos(0) { seek(pos); }
+	/// Reads from the input of a conversion, recording coverage and naming the file in messages
+	SpanReader(const ConversionContext &context, ByteSpan span, size_t pos = 0): span(span), pos(0), ctx(&context) { seek(pos); }
+
+	ByteSpan data() const { return span; }
+	/// The conversion this reader belongs to, if any
+	const ConversionContext *context() const { return ctx; }
+	size_t size() const { return span.size(); }
+	size_t tell() const { return pos; }
+
+	void seek(size_t newPos) {
+		if (newPos > span.size()) {
+			throw std::runtime_error("Tried to seek to offset " + std::to_string(newPos) + " of a " + std::to_string(span.size()) + " byte file");
+		}
+		pos = newPos;
+	}
+
+	void skip(size_t amount) {
+		span.subspan(pos, amount);
+		pos += amount;
+	}
+
+	/// Returns the next `length` bytes in place
+	ByteSpan readSpan(size_t length) {
+		ByteSpan out = span.subspan(pos, length);
+		recordCoverage(ctx, out);
+		pos += length;
+		return out;
+	}
+
+	void read(void *out, size_t length) {
+		memcpy(out, readSpan(length).data(), length);
+	}
+};
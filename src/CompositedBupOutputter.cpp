@@ -6,63 +6,99 @@ class CompositedBupOutputter: public BupOutputter {
 	fs::path basePath;
 	Image base;
 	std::string baseName;
-	Image withFace;
+	/// Base with the current face and mouth drawn on, modified in place for each variant
+	Image canvas;
 	std::string withFaceName;
-	Image withMouth;
 	std::string withMouthName;
+	/// Sections of `canvas` the current face was drawn over, restored from `base` on the next face
+	std::vector<MaskRect> faceDirty;
+	/// Sections of `canvas` the current mouth was drawn over, along with what was there before it
+	std::vector<MaskRect> mouthDirty;
+	std::vector<Image> underMouth;
+
+	void clearMouth() {
+		for (size_t i = 0; i < mouthDirty.size(); i++) {
+			const auto& rect = mouthDirty[i];
+			underMouth[i].drawOnto(canvas, {rect.x1, rect.y1}, underMouth[i].size);
+		}
+		mouthDirty.clear();
+	}
+	void clearFace() {
+		clearMouth();
+		base.drawOnto(canvas, {0, 0}, faceDirty);
+		faceDirty.clear();
+	}
 public:
+	using BupOutputter::BupOutputter;
 	void setBase(fs::path basePath, Image img, std::string name) override {
 		this->basePath = std::move(basePath);
 		base = std::move(img);
+		canvas = base;
 		baseName = std::move(name);
 		withFaceName = "";
 		withMouthName = "";
+		faceDirty.clear();
+		mouthDirty.clear();
 	}
 	void newFace(const Image& img, Point pos, const std::string& name, const std::vector<MaskRect>& mask) override {
-		withFace = base;
+		clearFace();
 		withMouthName = "";
 		if (img.empty()) {
 			withFaceName = baseName;
 		} else {
 			withFaceName = baseName + "_" + name;
-			img.drawOnto(withFace, pos, mask);
+			img.drawOnto(canvas, pos, mask);
+			faceDirty = offsetMasks(mask, pos);
 		}
 	}
 	void newMouth(const Image& img, Point pos, int num, const std::vector<MaskRect>& mask) override {
-		withMouth = withFace;
+		clearMouth();
 		withMouthName = withFaceName + "_" + std::to_string(num);
-		img.drawOnto(withMouth, pos, mask);
-	}
-	void write() override {
-		if (!withMouthName.empty()) {
-			write(withMouth, basePath/fs::u8path(withMouthName + ".png"));
+		mouthDirty = offsetMasks(mask, pos);
+		if (underMouth.size() < mouthDirty.size()) {
+			underMouth.resize(mouthDirty.size());
 		}
-		else if (!withFaceName.empty()) {
-			write(withFace, basePath/fs::u8path(withFaceName + ".png"));
+		// Save everything before drawing so overlapping sections restore correctly
+		for (size_t i = 0; i < mouthDirty.size(); i++) {
+			const auto& rect = mouthDirty[i];
+			underMouth[i].fastResize({rect.x2 - rect.x1, rect.y2 - rect.y1});
+			canvas.drawOnto(underMouth[i], {0, 0}, {rect.x1, rect.y1}, underMouth[i].size);
 		}
-		else {
-			write(base, basePath/fs::u8path(baseName + ".png"));
+		img.drawOnto(canvas, pos, mask);
+	}
+	void write() override {
+		const std::string& name = !withMouthName.empty() ? withMouthName
+		                        : !withFaceName.empty()  ? withFaceName
+		                        : baseName;
+		fs::path path = basePath/fs::u8path(name + ".png");
+		if (ctx.thumbnailSize > 0) {
+			Downscaler thumbnail(canvas.size, Downscaler::thumbnailSize(canvas.size, ctx.thumbnailSize));
+			thumbnail.add(canvas, {0, 0}, {{0, 0, static_cast<uint16_t>(canvas.size.width), static_cast<uint16_t>(canvas.size.height)}});
+			write(thumbnail.result(), std::move(path));
+		} else {
+			write(canvas, std::move(path));
 		}
 	}
-	virtual void write(Image& img, fs::path path) {
-		img.writePNG(path);
+	virtual void write(const Image& img, fs::path path) {
+		saveImage(ctx, path, PNGColorType::RGBA, img.size, reinterpret_cast<const uint8_t *>(img.colorData.data()));
 	}
 };
 
 #if ENABLE_MULTITHREADED
 class MTCompositedBupOutputter: public CompositedBupOutputter {
-	ThreadedImageSaver writer;
 public:
-	void write(Image& img, fs::path path) override {
-		writer.enqueue(std::move(img), std::move(path));
+	using CompositedBupOutputter::CompositedBupOutputter;
+	void write(const Image& img, fs::path path) override {
+		// The canvas gets reused for the next variant, so the saver needs its own copy
+		saveImage(ctx, img, std::move(path));
 	}
 };
 #endif
 
-std::unique_ptr<BupOutputter> BupOutputter::makeComposited() {
+std::unique_ptr<BupOutputter> BupOutputter::makeComposited(const ConversionContext &ctx) {
 #if ENABLE_MULTITHREADED
-	return std::make_unique<MTCompositedBupOutputter>();
+	return std::make_unique<MTCompositedBupOutputter>(ctx);
 #else
-	return std::make_unique<CompositedBupOutputter>();
+	return std::make_unique<CompositedBupOutputter>(ctx);
 #endif
 }
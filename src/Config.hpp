@@ -4,9 +4,52 @@
 #  define ENABLE_MULTITHREADED 0
 #endif
 
+#include <ostream>
+#include <string>
+#include <vector>
 #include "FS.hpp"
 
-extern fs::path currentFileName;
-extern bool SHOULD_WRITE_DEBUG_IMAGES;
-extern bool SAVE_BUP_AS_PARTS;
-extern fs::path debugImagePath;
+class OutputRecorder;
+class RegionChecker;
+class ImageSink;
+
+/// Options and state for converting one input, passed down through every function that converts it
+/// Each conversion gets its own, so any number of files can be converted at once in one process
+struct ConversionContext {
+	/// The input file, for messages
+	fs::path fileName;
+	/// Folder to write individual chunks to for debugging, empty to not write them
+	fs::path debugImagePath;
+	bool saveBupAsParts = false;
+	bool printStats = false;
+	/// Decode pic files one row of chunks at a time, writing out finished rows immediately
+	bool streamPic = false;
+	/// Scale pic and composited bup output down to fit in a square this size, 0 for full size output
+	int thumbnailSize = 0;
+	/// Glob patterns of txa chunk / bup expression names to extract, empty to extract everything
+	std::vector<std::string> onlyNames;
+	/// Told about every file written, if set
+	OutputRecorder *recorder = nullptr;
+	/// Told about every byte the decoder used, if set
+	RegionChecker *coverage = nullptr;
+	/// Gets every output image in memory instead of it being written to a file, if set
+	ImageSink *sink = nullptr;
+	/// Gets the PNG of a single image conversion instead of it being written to the output path, if set
+	std::ostream *outputStream = nullptr;
+
+	bool writeDebugImages() const { return !debugImagePath.empty(); }
+	/// Whether the txa chunk / bup expression with the given name was selected by `onlyNames`
+	bool isNameSelected(const std::string &name) const;
+	/// Tells the recorder, if any, about a file that was written
+	void recordOutput(const fs::path &path) const;
+};
+
+// Process-wide settings for the shared thread pool and pipeline stages
+/// From -j, 0 to pick based on the available CPUs
+extern int THREAD_COUNT;
+/// Bytes of images the encode stage can hold before making its producers wait, from -save-queue
+extern size_t SAVE_QUEUE_BYTES;
+/// Threads for each stage of the batch pipeline, from -stage-threads, 0 to use the default
+extern int READ_THREADS;
+extern int DECODE_THREADS;
+extern int ENCODE_THREADS;
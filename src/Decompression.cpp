@@ -1,11 +1,13 @@
 #include "Decompression.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <fstream>
 #include <cassert>
 #include <unordered_map>
 #include "HeaderStructs.hpp"
+#include "Utilities.hpp"
 
 static Size align(Size size) {
 	return { (size.width + 3) & ~3, size.height };
@@ -17,13 +19,13 @@ static void swapBR(Image &image) {
 	}
 }
 
-bool decompressHigu(std::vector<uint8_t> &output, const uint8_t *input, int inputLength, bool isSwitch) {
+bool decompressHigu(std::vector<uint8_t> &output, const uint8_t *input, size_t inputLength, bool isSwitch, size_t outputLimit) {
 	int marker = 1;
-	int p = 0;
+	size_t p = 0;
 
 	output.clear();
 
-	while (p < inputLength) {
+	while (p < inputLength && output.size() < outputLimit) {
 		if (marker == 1) {
 			marker = 0x100 | input[p++];
 		}
@@ -60,6 +62,9 @@ bool decompressHigu(std::vector<uint8_t> &output, const uint8_t *input, int inpu
 
 		marker >>= 1;
 	}
+	if (output.size() > outputLimit) {
+		output.resize(outputLimit);
+	}
 	return true;
 }
 
@@ -83,28 +88,34 @@ void prepareWriteRGB(std::vector<uint8_t> &output, const Image &image) {
 	}
 }
 
-bool getIndexed(Image &output, const std::vector<uint8_t> &input, Size size, bool isSwitch, int colors) {
-	assert(input.size() >= colors * 4 + size.area());
+bool getIndexed(Image &output, const uint8_t *input, size_t inputSize, Size size, bool isSwitch, int colors) {
+	assert(inputSize >= colors * 4 + size.area());
 	int imgStart = colors * 4;
 	int maskStart = imgStart + size.area();
-	std::vector<Color> table((Color *)&input[0], (Color *)&input[imgStart]);
+	std::vector<Color> table(colors);
+	memcpy(table.data(), input, imgStart);
 
 	output.size = size;
 	output.colorData.clear();
 	for (int i = imgStart; i < maskStart; i++) {
 		output.colorData.push_back(table[input[i]]);
 	}
-	for (int i = maskStart; i < input.size(); i++) {
+	for (int i = maskStart; i < inputSize; i++) {
 		int x = (i - maskStart) % size.width;
 		int y = (i - maskStart) / size.width;
 		output.pixel(x, y).a = input[i];
 	}
 
 	if (!isSwitch) { swapBR(output); }
-	return maskStart != input.size();
+	return maskStart != inputSize;
 }
 
-static void printDebugAndWrite(const Image &currentOutput, const ChunkHeader &header, const std::vector<MaskRect> &maskData, const std::string &name, std::istream &file) {
+static void printDebugAndWrite(const ConversionContext &ctx, const Image &currentOutput, const ChunkHeader &header, const std::vector<MaskRect> &maskData, const std::string &name) {
+#if ENABLE_MULTITHREADED
+	// Chunks may be decoded on multiple threads, keep each chunk's info together
+	static std::mutex mtx;
+	std::lock_guard<std::mutex> lock(mtx);
+#endif
 	std::cout << "========== " << name << " ==========" << std::endl;
 	std::cout << "               Type " << header.type << std::endl;
 	std::cout << "              Masks " << header.masks.size() << std::endl;
@@ -114,13 +125,13 @@ static void printDebugAndWrite(const Image &currentOutput, const ChunkHeader &he
 	std::cout << "                W H " << header.w << " " << header.h << std::endl;
 	std::cout << "               Size " << header.size << std::endl;
 
-	currentOutput.writePNG(debugImagePath/(name + ".png"));
+	currentOutput.writePNG(ctx.debugImagePath/(name + ".png"));
 	Image masked(currentOutput.size);
 	currentOutput.drawOnto(masked, {0, 0}, maskData);
-	masked.writePNG(debugImagePath/(name + "_masked.png"));
+	masked.writePNG(ctx.debugImagePath/(name + "_masked.png"));
 }
 
-static void processChunkShared(Image &output, uint32_t size, ChunkHeader::Type type, int width, int height, std::istream &file, const std::string &name, bool isSwitch) {
+static void processChunkShared(const ConversionContext &ctx, Image &output, uint32_t size, ChunkHeader::Type type, int width, int height, ByteSpan data, const std::string &name, bool isSwitch) {
 	std::vector<uint8_t> decompressed;
 	Size alignedSize = align({width, height});
 
@@ -129,22 +140,22 @@ static void processChunkShared(Image &output, uint32_t size, ChunkHeader::Type t
 		if (type != ChunkHeader::TYPE_INDEXED) {
 			throw std::runtime_error("Expected a size-0 type to be 3 (indexed, no alpha) but it wasn't...");
 		}
-		size = 1024 + alignedSize.area();
-		std::vector<uint8_t> chunk(size);
-		file.read((char *)chunk.data(), chunk.size());
-		getIndexed(output, chunk, alignedSize, isSwitch);
+		ByteSpan chunk = data.subspan(0, 1024 + alignedSize.area());
+		recordCoverage(&ctx, chunk);
+		getIndexed(output, chunk.data(), chunk.size(), alignedSize, isSwitch);
 		return;
 	}
 	else {
-		std::vector<uint8_t> compressed(size);
-		file.read((char *)compressed.data(), compressed.size());
-		if (!decompressHigu(decompressed, compressed.data(), (int)compressed.size(), isSwitch)) {
+		// Decompress straight out of the mapped file
+		ByteSpan compressed = data.subspan(0, size);
+		recordCoverage(&ctx, compressed);
+		if (!decompressHigu(decompressed, compressed.data(), compressed.size(), isSwitch)) {
 			throw std::runtime_error("Decompression of " + name + " failed");
 		}
 	}
 
 	if (type == ChunkHeader::TYPE_INDEXED || type == ChunkHeader::TYPE_INDEXED_ALPHA) {
-		getIndexed(output, decompressed, alignedSize, isSwitch);
+		getIndexed(output, decompressed.data(), decompressed.size(), alignedSize, isSwitch);
 	}
 	else {
 		output.fastResize(alignedSize);
@@ -160,51 +171,51 @@ static void processChunkShared(Image &output, uint32_t size, ChunkHeader::Type t
 	}
 }
 
-void processChunkNoHeader(Image &output, uint32_t offset, uint32_t size, int indexed, int width, int height, std::istream &file, const std::string &name, bool isSwitch) {
-	file.seekg(offset);
-
+void processChunkNoHeader(const ConversionContext &ctx, Image &output, uint32_t offset, uint32_t size, int indexed, int width, int height, ByteSpan file, const std::string &name, bool isSwitch) {
 	ChunkHeader::Type type = indexed ? ChunkHeader::TYPE_INDEXED : ChunkHeader::TYPE_COLOR;
-	processChunkShared(output, size, type, width, height, file, name, isSwitch);
+	processChunkShared(ctx, output, size, type, width, height, file.subspan(offset), name, isSwitch);
 }
 
-Point processChunk(Image &output, std::vector<MaskRect> &outputMasks, uint32_t offset, std::istream &file, const std::string &name, bool isSwitch) {
-	file.seekg(offset, file.beg);
+Point processChunk(const ConversionContext &ctx, Image &output, std::vector<MaskRect> &outputMasks, uint32_t offset, ByteSpan file, const std::string &name, bool isSwitch) {
+	SpanReader reader(ctx, file, offset);
 	ChunkHeader header;
-	file >> header;
+	reader >> header;
 
 	outputMasks.reserve(header.masks.size() + header.transparentMasks.size());
 	outputMasks = header.masks;
 	outputMasks.insert(outputMasks.end(), header.transparentMasks.begin(), header.transparentMasks.end());
 
-	processChunkShared(output, header.size, header.type, header.w, header.h, file, name, isSwitch);
+	processChunkShared(ctx, output, header.size, header.type, header.w, header.h, file.subspan(reader.tell()), name, isSwitch);
 
-	if (SHOULD_WRITE_DEBUG_IMAGES) {
-		printDebugAndWrite(output, header, outputMasks, name, file);
+	if (ctx.writeDebugImages()) {
+		printDebugAndWrite(ctx, output, header, outputMasks, name);
 	}
 
 	return {header.x, header.y};
 }
 
-void debugDecompress(uint32_t offset, uint32_t size, std::istream &in, bool isSwitch) {
-	std::vector<uint8_t> data(size);
-	std::vector<uint8_t> output;
-	in.seekg(offset, in.beg);
-	ChunkHeader header;
-	in >> header;
-	in.seekg(offset, in.beg);
-	in.read((char *)data.data(), data.size());
-
-	for (int i = 0; i < data.size(); i++) {
-		if (decompressHigu(output, data.data() + i, (int)data.size() - i, isSwitch)) {
-			std::ofstream out("/tmp/chunks/data" + std::to_string(i) + ".dat", std::ios::binary);
-			out.write((char *)output.data(), output.size());
-			if (output.size() >= 1024 + header.w * header.h) {
-				Image img({0, 0});
-				getIndexed(img, output, align({header.w, header.h}), isSwitch);
-				img.writePNG("/tmp/chunks/data" + std::to_string(i) + ".png");
-			}
+int debugDecompress(const ConversionContext &ctx, ByteSpan file, uint64_t offset, uint64_t size, bool isSwitch, const fs::path &outputDir, size_t minOutput, size_t maxOutput, Size imageSize) {
+	ByteSpan data = file.subspan(offset, size);
+	Size alignedSize = align(imageSize);
+	std::atomic<size_t> found{0};
+
+	// Every start offset is independent, and each one stops as soon as it hits an invalid back reference or decodes `maxOutput` bytes
+	parallel_for(0, data.size(), []{ return std::vector<uint8_t>(); }, [&](std::vector<uint8_t> &output, size_t i) {
+		if (!decompressHigu(output, data.data() + i, data.size() - i, isSwitch, maxOutput)) { return; }
+		if (output.size() < minOutput) { return; }
+		found++;
+		std::string name = "data" + std::to_string(offset + i);
+		fs::ofstream out(outputDir/(name + ".dat"), std::ios::binary);
+		out.write((char *)output.data(), output.size());
+		if (alignedSize.area() > 0 && output.size() >= 1024 + alignedSize.area()) {
+			Image img({0, 0});
+			getIndexed(img, output.data(), 1024 + alignedSize.area(), alignedSize, isSwitch);
+			img.writePNG(outputDir/(name + ".png"));
 		}
-	}
+	});
+
+	std::cout << ctx.fileName.string() << ": " << found << " of " << data.size() << " offsets decompressed to a plausible size" << std::endl;
+	return 0;
 }
 
 // MARK: Compression
@@ -2,6 +2,9 @@
 
 #include <stdint.h>
 #include <vector>
+#include "ByteSpan.hpp"
+#include "Config.hpp"
+#include "FS.hpp"
 #include "Image.hpp"
 
 class Compressor {
@@ -20,14 +23,17 @@ public:
 	bool encodeHeaderlessChunk(std::vector<uint8_t>& output, const Image& input, ChunkHeader::Type type, bool isSwitch);
 };
 
-bool decompressHigu(std::vector<uint8_t> &output, const uint8_t *input, int inputLength, bool isSwitch);
+/// Stops once `outputLimit` bytes have been decoded, treating that as success
+bool decompressHigu(std::vector<uint8_t> &output, const uint8_t *input, size_t inputLength, bool isSwitch, size_t outputLimit = SIZE_MAX);
 
-bool getIndexed(Image &output, const std::vector<uint8_t> &input, Size size, bool isSwitch, int colors = 256);
+bool getIndexed(Image &output, const uint8_t *input, size_t inputSize, Size size, bool isSwitch, int colors = 256);
 
 void getRGB(Image &image, const std::vector<uint8_t> &data, bool isSwitch);
 
-void processChunkNoHeader(Image &output, uint32_t offset, uint32_t size, int indexed, int width, int height, std::istream &file, const std::string &name, bool isSwitch);
+void processChunkNoHeader(const ConversionContext &ctx, Image &output, uint32_t offset, uint32_t size, int indexed, int width, int height, ByteSpan file, const std::string &name, bool isSwitch);
 
-Point processChunk(Image &output, std::vector<MaskRect> &outputMasks, uint32_t offset, std::istream &file, const std::string &name, bool isSwitch);
+Point processChunk(const ConversionContext &ctx, Image &output, std::vector<MaskRect> &outputMasks, uint32_t offset, ByteSpan file, const std::string &name, bool isSwitch);
 
-void debugDecompress(uint32_t offset, uint32_t size, std::istream &in, bool isSwitch);
+/// Tries decompressing from every offset in `[offset, offset + size)`, writing each result between `minOutput` and `maxOutput` bytes long to `outputDir`
+/// Results long enough to be an indexed image of `imageSize` are also written as PNGs
+int debugDecompress(const ConversionContext &ctx, ByteSpan file, uint64_t offset, uint64_t size, bool isSwitch, const fs::path &outputDir, size_t minOutput, size_t maxOutput, Size imageSize);
@@ -0,0 +1,207 @@
+#include "EnterExtractor.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/endian/buffers.hpp>
+
+#include "Config.hpp"
+#include "FileTypes.hpp"
+#include "HeaderStructs.hpp"
+#include "Utilities.hpp"
+
+namespace {
+
+thread_local std::string lastError;
+
+ee_status fail(ee_status status, std::string message) {
+	lastError = std::move(message);
+	return status;
+}
+
+/// Output name given to conversions, stripped off the front of image names
+const char *OUTPUT_NAME = "image";
+
+ee_file_type fileType(ByteSpan in) {
+	if (in.size() < 4) { return EE_UNKNOWN; }
+	boost::endian::big_int32_buf_t magic;
+	memcpy(&magic, in.data(), 4);
+	switch (magic.value()) {
+		case 'PIC4': return EE_PIC;
+		case 'BUP4': return EE_BUP;
+		case 'TXA4': return EE_TXA;
+		case 'MSK3': return EE_MSK3;
+		case 'MSK4': return EE_MSK4;
+	}
+	return EE_UNKNOWN;
+}
+
+/// Keeps the images a conversion outputs instead of writing them to files
+class MemorySink: public ImageSink {
+public:
+	struct Entry {
+		std::string name;
+		Size size;
+		uint32_t channels;
+		std::vector<uint8_t> pixels;
+		std::vector<uint8_t> png;
+	};
+
+	explicit MemorySink(bool encode): encode(encode) {}
+
+	void add(const fs::path &path, PNGColorType color, Size size, const uint8_t *data) override {
+		Entry entry;
+		std::string stem = path.stem().string();
+		size_t prefix = strlen(OUTPUT_NAME);
+		entry.name = stem.size() > prefix ? stem.substr(prefix + 1) : "";
+		entry.size = size;
+		entry.channels = color == PNGColorType::GRAY ? 1 : color == PNGColorType::RGB ? 3 : 4;
+		entry.pixels.assign(data, data + size.area() * entry.channels);
+		if (encode) {
+			entry.png = encodePNG(color, size, data);
+		}
+#if ENABLE_MULTITHREADED
+		std::lock_guard<std::mutex> l(mtx);
+#endif
+		entries.push_back(std::move(entry));
+	}
+
+	std::vector<Entry> entries;
+
+private:
+	bool encode;
+#if ENABLE_MULTITHREADED
+	std::mutex mtx;
+#endif
+};
+
+/// Everything an `ee_result` points to
+struct ResultStorage {
+	ee_result result;
+	std::vector<MemorySink::Entry> entries;
+	std::vector<ee_image> images;
+};
+
+}
+
+extern "C" ee_status ee_inspect(const void *data, size_t size, ee_info *info) {
+	if (!data || !info) { return fail(EE_INVALID_ARGUMENT, "data and info must not be null"); }
+	ByteSpan in(static_cast<const uint8_t *>(data), size);
+	*info = ee_info();
+	info->type = fileType(in);
+	ConversionContext ctx;
+	ctx.fileName = "<buffer>";
+	try {
+		SpanReader reader(ctx, in);
+		switch (info->type) {
+			case EE_PIC: {
+				PicHeader header;
+				reader >> header;
+				*info = {info->type, header.isSwitch, header.width, header.height, static_cast<uint32_t>(header.chunks.size()), 0};
+				break;
+			}
+			case EE_BUP: {
+				BupHeader header;
+				reader >> header;
+				*info = {info->type, header.isSwitch, header.width, header.height, static_cast<uint32_t>(header.chunks.size()), static_cast<uint32_t>(header.expChunks.size())};
+				break;
+			}
+			case EE_TXA: {
+				TxaHeader header;
+				reader >> header;
+				*info = {info->type, header.isSwitch, 0, 0, static_cast<uint32_t>(header.chunks.size()), 0};
+				break;
+			}
+			case EE_MSK3: {
+				Msk3Header header;
+				reader >> header;
+				*info = {info->type, header.isSwitch, header.width, header.height, 0, 0};
+				break;
+			}
+			case EE_MSK4: {
+				// Only the Switch version has MSK4s
+				Msk4Header header;
+				reader >> header;
+				*info = {info->type, 1, header.width, header.height, 0, 0};
+				break;
+			}
+			case EE_UNKNOWN:
+				return fail(EE_UNSUPPORTED, "Unknown file type");
+		}
+	} catch (std::exception &e) {
+		return fail(EE_DECODE_FAILED, e.what());
+	}
+	return EE_OK;
+}
+
+extern "C" ee_status ee_decode(const void *data, size_t size, const ee_options *options, ee_result **result) {
+	if (!data || !result) { return fail(EE_INVALID_ARGUMENT, "data and result must not be null"); }
+	ByteSpan in(static_cast<const uint8_t *>(data), size);
+	if (fileType(in) == EE_UNKNOWN) { return fail(EE_UNSUPPORTED, "Unknown file type"); }
+	boost::endian::big_int32_buf_t magic;
+	memcpy(&magic, in.data(), 4);
+	ProcessFunction process = processFunctionFor(magic.value());
+
+	MemorySink sink(options && options->encode_png);
+	ConversionContext ctx;
+	ctx.fileName = "<buffer>";
+	ctx.sink = &sink;
+	if (options) {
+		ctx.thumbnailSize = std::max(options->thumbnail_size, 0);
+		std::string names = options->only ? options->only : "";
+		for (size_t start = 0; start <= names.size();) {
+			size_t end = std::min(names.find(',', start), names.size());
+			if (end > start) {
+				ctx.onlyNames.push_back(names.substr(start, end - start));
+			}
+			start = end + 1;
+		}
+	}
+
+	try {
+		if (process(ctx, in, fs::path(OUTPUT_NAME) += ".png") != 0) {
+			return fail(EE_DECODE_FAILED, "Conversion failed");
+		}
+	} catch (std::exception &e) {
+		return fail(EE_DECODE_FAILED, e.what());
+	}
+
+	auto storage = std::make_unique<ResultStorage>();
+	storage->entries = std::move(sink.entries);
+	// Txa chunks are decoded in parallel, so give them a predictable order
+	std::stable_sort(storage->entries.begin(), storage->entries.end(), [](const auto &a, const auto &b){ return a.name < b.name; });
+	for (const auto &entry : storage->entries) {
+		ee_image image;
+		image.name = entry.name.c_str();
+		image.width = entry.size.width;
+		image.height = entry.size.height;
+		image.channels = entry.channels;
+		image.pixels = entry.pixels.data();
+		image.png = entry.png.empty() ? nullptr : entry.png.data();
+		image.png_size = entry.png.size();
+		storage->images.push_back(image);
+	}
+	storage->result.images = storage->images.data();
+	storage->result.count = storage->images.size();
+	storage->result.internal = storage.get();
+	*result = &storage.release()->result;
+	return EE_OK;
+}
+
+extern "C" void ee_free_result(ee_result *result) {
+	if (result) {
+		delete static_cast<ResultStorage *>(result->internal);
+	}
+}
+
+extern "C" const char *ee_last_error(void) {
+	return lastError.c_str();
+}
+
+extern "C" void ee_set_thread_count(int threads) {
+	THREAD_COUNT = std::max(threads, 0);
+}
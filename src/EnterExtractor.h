@@ -0,0 +1,95 @@
+#pragma once
+
+/// In-memory interface to the converter, for programs that link libenterextractor instead of running EnterExtractor
+/// Usable from C and C++, every function is safe to call from multiple threads at once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum ee_status {
+	EE_OK = 0,
+	/// A null pointer or otherwise unusable argument was passed
+	EE_INVALID_ARGUMENT,
+	/// The data isn't a file type the library understands
+	EE_UNSUPPORTED,
+	/// The file is damaged or uses a feature the decoder doesn't support, `ee_last_error` says what went wrong
+	EE_DECODE_FAILED,
+} ee_status;
+
+typedef enum ee_file_type {
+	EE_UNKNOWN = 0,
+	EE_PIC,
+	EE_BUP,
+	EE_TXA,
+	EE_MSK3,
+	EE_MSK4,
+} ee_file_type;
+
+/// What `ee_inspect` found in a file's header
+typedef struct ee_info {
+	ee_file_type type;
+	/// Nonzero for files from the Switch version, zero for PS3 ones
+	int is_switch;
+	/// Size of the full image, zero for txa files, whose chunks all have their own sizes
+	uint32_t width;
+	uint32_t height;
+	/// Image chunks in the file (for bup files, the ones making up the base image)
+	uint32_t chunk_count;
+	/// Expressions in a bup file, zero for other types
+	uint32_t expression_count;
+} ee_info;
+
+typedef struct ee_options {
+	/// Scale pic and bup images down to fit in a square this size, 0 for full size images
+	int thumbnail_size;
+	/// Comma separated names of the txa chunks / bup expressions to decode, which may use * and ? wildcards, NULL to decode everything
+	const char *only;
+	/// Also encode each image as a PNG
+	int encode_png;
+} ee_options;
+
+typedef struct ee_image {
+	/// UTF-8 name the image would have been given after the output name when converting to files (e.g. the txa chunk name), empty for pic and msk files
+	const char *name;
+	uint32_t width;
+	uint32_t height;
+	/// 4 for RGBA images, 1 for grayscale msk images
+	uint32_t channels;
+	/// `width * height * channels` bytes, rows top to bottom
+	const uint8_t *pixels;
+	/// The image as a PNG file if `encode_png` was set, otherwise NULL
+	const uint8_t *png;
+	size_t png_size;
+} ee_image;
+
+typedef struct ee_result {
+	/// Sorted by name
+	const ee_image *images;
+	size_t count;
+	/// Owned by the library
+	void *internal;
+} ee_result;
+
+/// Reads the header of the file in `data` without decoding any images
+ee_status ee_inspect(const void *data, size_t size, ee_info *info);
+
+/// Decodes every image in the file in `data`, `options` may be NULL to use the defaults
+/// On success `*result` must be freed with `ee_free_result`
+ee_status ee_decode(const void *data, size_t size, const ee_options *options, ee_result **result);
+
+void ee_free_result(ee_result *result);
+
+/// Describes the last error returned on the calling thread
+const char *ee_last_error(void);
+
+/// Sets the number of threads decoding uses, 0 to use the number of CPUs available to the process
+/// Only has an effect before the first call to `ee_decode`
+void ee_set_thread_count(int threads);
+
+#ifdef __cplusplus
+}
+#endif
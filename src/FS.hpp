@@ -16,6 +16,9 @@ namespace fs {
 }
 #endif
 
+/// Whether `path` is "-", which stands for stdin or stdout in place of a file name
+inline bool isStdio(const fs::path &path) { return path == "-"; }
+
 #ifdef _WIN32
 # define FOPEN(file, mode) _wfopen(file, L##mode)
 #else
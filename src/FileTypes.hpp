@@ -1,17 +1,39 @@
 #pragma once
 
 #include <iostream>
+#include "ByteSpan.hpp"
+#include "Config.hpp"
 #include "FS.hpp"
+#include "Image.hpp"
 
 // Defined in Pic.cpp
-int processPic(std::istream &in, const fs::path &output);
-int replacePic(std::istream &in, std::ostream &output, const fs::path &replacementFile);
+int processPic(const ConversionContext &ctx, ByteSpan in, const fs::path &output);
+/// Decodes only the given region of the pic, skipping chunks outside of it
+int processPicRegion(const ConversionContext &ctx, ByteSpan in, const fs::path &output, Point position, Size size);
+/// Decodes the pic using the given msk file as its alpha channel
+int processPicWithMask(const ConversionContext &ctx, ByteSpan in, const fs::path &output, const fs::path &maskFile);
+int replacePic(const ConversionContext &ctx, ByteSpan in, std::ostream &output, const fs::path &replacementFile);
 // Defined in Bup.cpp
-int processBup(std::istream &in, const fs::path &output);
+int processBup(const ConversionContext &ctx, ByteSpan in, const fs::path &output);
 // Defined in Txa.cpp
-int processTxa(std::istream &in, const fs::path &output);
-int replaceTxa(std::istream &in, std::ostream &output, const fs::path &replacementFile);
+int processTxa(const ConversionContext &ctx, ByteSpan in, const fs::path &output);
+int replaceTxa(const ConversionContext &ctx, ByteSpan in, std::ostream &output, const fs::path &replacementFile);
 // Defined in Msk.cpp
-int processMsk3(std::istream &in, const fs::path &output);
+int processMsk3(const ConversionContext &ctx, ByteSpan in, const fs::path &output);
 // Defined in Msk.cpp
-int processMsk4(std::istream &in, const fs::path &output);
+int processMsk4(const ConversionContext &ctx, ByteSpan in, const fs::path &output);
+/// Decodes an MSK3 or MSK4 file to a plane of 8-bit values
+std::vector<uint8_t> decodeMsk(const ConversionContext &ctx, ByteSpan in, Size &size);
+
+typedef int (*ProcessFunction)(const ConversionContext &ctx, ByteSpan in, const fs::path &output);
+// Defined in Batch.cpp
+/// Returns the function that extracts files with the given magic, or null if the file type isn't supported
+ProcessFunction processFunctionFor(uint32_t magic);
+/// Converts every supported file under `input` into a png (or pngs) at the same place in a copy of the tree under `output`, using the options in `options`
+/// If `manifest` isn't empty, it's used to skip inputs that haven't changed since the last run and remove outputs that are no longer produced
+/// Only inputs in shard `shard` of `shardCount` are converted, so separate processes can each take a shard of the same tree
+int processDirectory(const ConversionContext &options, const fs::path &input, const fs::path &output, const fs::path &manifest, uint32_t shard = 0, uint32_t shardCount = 1);
+// Defined in Serve.cpp
+/// Reads newline delimited JSON jobs from stdin (or from connections to the Unix socket `socketPath`, if not empty) and runs them on the shared pool, using `options` as the defaults for each job
+/// Writes a JSON completion record for each job once its outputs are saved, in the order jobs complete
+int serve(const ConversionContext &options, const fs::path &socketPath);
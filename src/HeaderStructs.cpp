@@ -49,9 +49,17 @@ static std::string fromUTF8(const std::string& str) {
 }
 #else
 #include <iconv.h>
-static const iconv_t iconv_toutf   = iconv_open("UTF-8", "CP932");
-static const iconv_t iconv_fromutf = iconv_open("CP932", "UTF-8");
+/// Converters keep state between calls, so each thread gets its own
+struct IconvConverter {
+	iconv_t conv;
+	IconvConverter(const char* to, const char* from): conv(iconv_open(to, from)) {}
+	~IconvConverter() {
+		if (conv != (iconv_t)-1) { iconv_close(conv); }
+	}
+};
 static std::string iconv_convert(const char* src, size_t len, iconv_t conv) {
+	// Clear anything left over from a conversion that failed partway through
+	iconv(conv, nullptr, nullptr, nullptr, nullptr);
 	std::string out;
 	char buffer[512];
 	size_t res;
@@ -68,10 +76,12 @@ static std::string iconv_convert(const char* src, size_t len, iconv_t conv) {
 	return out;
 }
 static std::string toUTF8(const char* src, size_t len) {
-	return iconv_convert(src, len, iconv_toutf);
+	static thread_local IconvConverter toUTF("UTF-8", "CP932");
+	return iconv_convert(src, len, toUTF.conv);
 }
 static std::string fromUTF8(const std::string& str) {
-	return iconv_convert(str.data(), str.size(), iconv_fromutf);
+	static thread_local IconvConverter fromUTF("CP932", "UTF-8");
+	return iconv_convert(str.data(), str.size(), fromUTF.conv);
 }
 #endif
 
@@ -80,20 +90,18 @@ bool allZero(const T& t) {
 	return std::all_of(t.begin(), t.end(), [](uint32_le x){ return x.value() == 0; });
 };
 
-/// Returns -1 if the file is PS3, the version number if the file is switch
-static int detectSwitch(std::istream &in) {
-	in.seekg(0, in.end);
-	int size = in.tellg();
-	in.seekg(4, in.beg);
+int detectSwitch(const SpanReader &in) {
+	// The file size fields are unsigned 32-bit, so files over 4 GiB never match them rather than matching a truncated size
+	uint64_t size = in.size();
 	boost::endian::little_int32_buf_t buf[2];
-	in.read((char *)buf, sizeof(buf));
-	in.seekg(0, in.beg);
-	if (buf[1].value() == size) {
+	SpanReader(in.data(), 4).read(buf, sizeof(buf));
+	if (static_cast<uint32_t>(buf[1].value()) == size) {
 		return buf[0].value();
 	}
 	else {
-		if (buf[0].value() != size) {
-			std::cerr << "Failed to autodetect file type of " << currentFileName << ", guessing PS3" << std::endl;
+		if (static_cast<uint32_t>(buf[0].value()) != size) {
+			fs::path fileName = in.context() ? in.context()->fileName : fs::path();
+			std::cerr << "Failed to autodetect file type of " << fileName << ", guessing PS3" << std::endl;
 		}
 		return -1;
 	}
@@ -391,16 +399,16 @@ static_assert(sizeof(Msk4HeaderSwitch) == 28, "Expected Msk4HeaderSwitch to be 2
 
 // readRaw will stop at a RAW_END if it's defined on a type
 template <typename Thing, typename = decltype(Thing::RAW_END)>
-Thing readRaw(std::istream& stream) {
+Thing readRaw(SpanReader& stream) {
 	Thing t;
-	stream.read((char*)&t, offsetof(Thing, RAW_END));
+	stream.read(&t, offsetof(Thing, RAW_END));
 	return t;
 }
 
 template <typename Thing>
-Thing readRaw(std::istream& stream) {
+Thing readRaw(SpanReader& stream) {
 	Thing t;
-	stream.read((char*)&t, sizeof(t));
+	stream.read(&t, sizeof(t));
 	return t;
 }
 
@@ -422,17 +430,11 @@ void addZeroes(std::ostream& stream, int len) {
 	}
 }
 
-void copyBytes(std::ostream& dst, std::istream& src, int len) {
-	constexpr int BUFLEN = 512;
-	char buf[BUFLEN];
-	for (int i = 0; i < len; i += BUFLEN) {
-		int amt = std::min(len - i, BUFLEN);
-		src.read(buf, amt);
-		dst.write(buf, amt);
-	}
+void copyBytes(std::ostream& dst, SpanReader& src, int len) {
+	dst.write(reinterpret_cast<const char*>(src.readSpan(len).data()), len);
 }
 
-std::istream& operator>>(std::istream& stream, ChunkHeader& header) {
+SpanReader& operator>>(SpanReader& stream, ChunkHeader& header) {
 	auto h = readRaw<ChunkHeaderRaw>(stream);
 	header.type = static_cast<ChunkHeader::Type>(h.type.value());
 	header.masks.resize(h.masks.value());
@@ -449,7 +451,7 @@ std::istream& operator>>(std::istream& stream, ChunkHeader& header) {
 	for (auto& tmask : header.transparentMasks) {
 		tmask = readRaw<MaskRectRaw>(stream);
 	}
-	stream.ignore(header.alignmentWords * 2);
+	stream.skip(header.alignmentWords * 2);
 	return stream;
 }
 
@@ -473,10 +475,22 @@ std::ostream& operator<<(std::ostream& stream, const ChunkHeader& header) {
 		MaskRectRaw m = tmask;
 		writeRaw(stream, m);
 	}
-	stream.seekp(header.alignmentWords * 2, stream.cur);
+	seekpZeroFilled(stream, static_cast<std::streamoff>(stream.tellp()) + header.alignmentWords * 2);
 	return stream;
 }
 
+void seekpZeroFilled(std::ostream& stream, std::streamoff pos) {
+	std::streamoff end = stream.seekp(0, stream.end).tellp();
+	if (pos <= end) {
+		stream.seekp(pos, stream.beg);
+		return;
+	}
+	static const char zeros[256] = {};
+	for (; end < pos; end += std::min<std::streamoff>(pos - end, sizeof(zeros))) {
+		stream.write(zeros, std::min<std::streamoff>(pos - end, sizeof(zeros)));
+	}
+}
+
 size_t ChunkHeader::calcAlignmentGetBinSize() {
 	size_t binsize = sizeof(ChunkHeaderRaw) + sizeof(MaskRectRaw) * (masks.size() + transparentMasks.size());
 	size_t aligned = (binsize + 15) / 16 * 16;
@@ -487,7 +501,7 @@ size_t ChunkHeader::calcAlignmentGetBinSize() {
 // MARK: PIC
 
 template <typename Header>
-void readPic(std::istream& stream, PicHeader& header) {
+void readPic(SpanReader& stream, PicHeader& header) {
 	header.isSwitch = Header::IsSwitch::value;
 	Header h = readRaw<Header>(stream);
 	header.filesize = h.filesize.value();
@@ -498,7 +512,7 @@ void readPic(std::istream& stream, PicHeader& header) {
 	header.height = h.height.value();
 	header.chunks.resize(h.chunks.value());
 
-	stream.ignore(h.bytesToSkip());
+	stream.skip(h.bytesToSkip());
 
 	for (auto& chunk : header.chunks) {
 		auto c = readRaw<typename Header::Chunk>(stream);
@@ -509,7 +523,7 @@ void readPic(std::istream& stream, PicHeader& header) {
 	}
 }
 
-std::istream& operator>>(std::istream& stream, PicHeader& header) {
+SpanReader& operator>>(SpanReader& stream, PicHeader& header) {
 	int version = detectSwitch(stream);
 	if (version < 0) { // PS3
 		readPic<PicHeaderPS3>(stream, header);
@@ -535,8 +549,8 @@ size_t PicHeader::binSize() const {
 }
 
 template <typename Header>
-void writePic(std::ostream& stream, const PicHeader& header, std::istream& reference) {
-	reference.seekg(0, reference.beg);
+void writePic(std::ostream& stream, const PicHeader& header, ByteSpan file) {
+	SpanReader reference(file);
 	Header h = readRaw<Header>(reference);
 	h.filesize = header.filesize;
 	h.ew = header.ew;
@@ -552,7 +566,7 @@ void writePic(std::ostream& stream, const PicHeader& header, std::istream& refer
 	}
 }
 
-void PicHeader::write(std::ostream& stream, std::istream& reference) const {
+void PicHeader::write(std::ostream& stream, ByteSpan reference) const {
 	if (isSwitch) {
 		writePic<PicHeaderSwitch>(stream, *this, reference);
 	} else {
@@ -588,20 +602,20 @@ void copyTo(BupHeader& out, const Header& in) {
 };
 
 template <typename Header>
-void readBup(std::istream& stream, BupHeader& header) {
+void readBup(SpanReader& stream, BupHeader& header) {
 	header.isSwitch = Header::IsSwitch::value;
 	Header h = readRaw<Header>(stream);
 	copyTo(header, h);
 
 	// Skip bytes for unknown reason
-	stream.ignore(h.tbl1.value() * h.skipAmount);
+	stream.skip(h.tbl1.value() * h.skipAmount);
 
 	for (auto& chunk : header.chunks) {
 		auto c = readRaw<typename Header::Chunk>(stream);
 		copyTo(chunk, c);
 	}
 
-	stream.ignore(h.skipAmount2);
+	stream.skip(h.skipAmount2);
 
 	for (size_t i = 0; i < header.expChunks.size(); i++) {
 		auto& expChunk = header.expChunks[i];
@@ -620,7 +634,7 @@ void readBup(std::istream& stream, BupHeader& header) {
 	}
 }
 
-std::istream& operator>> (std::istream& stream, BupHeader &header) {
+SpanReader& operator>>(SpanReader& stream, BupHeader &header) {
 	int version = detectSwitch(stream);
 	if (version < 0) { // PS3
 		readBup<BupHeaderPS3>(stream, header);
@@ -641,7 +655,7 @@ std::istream& operator>> (std::istream& stream, BupHeader &header) {
 			copyTo(chunk, c);
 		}
 
-		while (stream.tellg() % 16 != 0) {
+		while (stream.tell() % 16 != 0) {
 			auto t = readRaw<uint32_le>(stream);
 			if (t.value() != 0) {
 				std::cerr << "Unexpected nonzero values in header" << std::endl;
@@ -675,7 +689,7 @@ std::istream& operator>> (std::istream& stream, BupHeader &header) {
 // MARK: TXA
 
 template<typename Header>
-void readTxa(std::istream& stream, TxaHeader& header) {
+void readTxa(SpanReader& stream, TxaHeader& header) {
 	header.isSwitch = Header::IsSwitch::value;
 	Header h = readRaw<Header>(stream);
 	header.indexed = h.indexed.value();
@@ -719,8 +733,8 @@ size_t TxaHeader::updateAndCalcBinSize() {
 }
 
 template <typename Header>
-void writeTxa(std::ostream& stream, const TxaHeader& header, std::istream& reference) {
-	reference.seekg(0, reference.beg);
+void writeTxa(std::ostream& stream, const TxaHeader& header, ByteSpan file) {
+	SpanReader reference(file);
 	Header h = readRaw<Header>(reference);
 	h.size = header.filesize;
 	h.setIndexSize(header.indexSize);
@@ -744,7 +758,7 @@ void writeTxa(std::ostream& stream, const TxaHeader& header, std::istream& refer
 	}
 }
 
-void TxaHeader::write(std::ostream& stream, std::istream& reference) const {
+void TxaHeader::write(std::ostream& stream, ByteSpan reference) const {
 	if (isSwitch) {
 		writeTxa<TxaHeaderSwitch>(stream, *this, reference);
 	} else {
@@ -752,7 +766,7 @@ void TxaHeader::write(std::ostream& stream, std::istream& reference) const {
 	}
 }
 
-std::istream& operator>>(std::istream& stream, TxaHeader& header) {
+SpanReader& operator>>(SpanReader& stream, TxaHeader& header) {
 	int version = detectSwitch(stream);
 	if (version < 0) { // PS3
 		readTxa<TxaHeaderPS3>(stream, header);
@@ -765,7 +779,7 @@ std::istream& operator>>(std::istream& stream, TxaHeader& header) {
 // MARK: MSK
 
 template<typename Header>
-void readMsk3(std::istream& stream, Msk3Header& header) {
+void readMsk3(SpanReader& stream, Msk3Header& header) {
 	header.isSwitch = Header::IsSwitch::value;
 	Header h = readRaw<Header>(stream);
 	header.width = h.width.value();
@@ -773,7 +787,7 @@ void readMsk3(std::istream& stream, Msk3Header& header) {
 	header.compressedSize = h.compressedSize.value();
 }
 
-std::istream& operator>>(std::istream& stream, Msk3Header& header) {
+SpanReader& operator>>(SpanReader& stream, Msk3Header& header) {
 	int version = detectSwitch(stream);
 	if (version < 0) { // PS3
 		readMsk3<Msk3HeaderPS3>(stream, header);
@@ -783,7 +797,7 @@ std::istream& operator>>(std::istream& stream, Msk3Header& header) {
 	return stream;
 }
 
-std::istream& operator>>(std::istream& stream, Msk4Header& header) {
+SpanReader& operator>>(SpanReader& stream, Msk4Header& header) {
 	int version = detectSwitch(stream);
 	if (version < 0) { // PS3
 		throw std::runtime_error("PS3 MSK4 decoding is unsupported");
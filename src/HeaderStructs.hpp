@@ -3,7 +3,8 @@
 #include <stdint.h>
 #include <vector>
 #include <string>
-#include <istream>
+#include <ostream>
+#include "ByteSpan.hpp"
 #include "Config.hpp"
 
 struct MaskRect {
@@ -11,8 +12,14 @@ struct MaskRect {
 	uint16_t y1;
 	uint16_t x2;
 	uint16_t y2;
+	bool intersects(const MaskRect& other) const {
+		return x1 < other.x2 && other.x1 < x2 && y1 < other.y2 && other.y1 < y2;
+	}
 };
 
+/// Returns -1 if the file is PS3, the version number if the file is switch
+int detectSwitch(const SpanReader &in);
+
 struct ChunkHeader {
 	enum Type : uint16_t {
 		TYPE_COLOR1        = 0, ///< Only observed in PS3, no noticeable difference between it and `TYPE_COLOR`
@@ -32,9 +39,12 @@ struct ChunkHeader {
 	size_t calcAlignmentGetBinSize();
 };
 
-std::istream& operator>>(std::istream& stream, ChunkHeader& header);
+SpanReader& operator>>(SpanReader& stream, ChunkHeader& header);
 std::ostream& operator<<(std::ostream& stream, const ChunkHeader& header);
 
+/// Moves the write position of `stream` to `pos`, writing zeros to get there if it's past the end, which string streams can't seek to
+void seekpZeroFilled(std::ostream& stream, std::streamoff pos);
+
 struct PicChunk {
 	uint16_t x;
 	uint16_t y;
@@ -52,10 +62,10 @@ struct PicHeader {
 	uint16_t height;
 	std::vector<PicChunk> chunks;
 	size_t binSize() const;
-	void write(std::ostream& stream, std::istream& reference) const;
+	void write(std::ostream& stream, ByteSpan reference) const;
 };
 
-std::istream& operator>>(std::istream& stream, PicHeader& header);
+SpanReader& operator>>(SpanReader& stream, PicHeader& header);
 
 struct BupChunk {
 	uint32_t offset;
@@ -77,7 +87,7 @@ struct BupHeader {
 	std::vector<BupExpressionChunk> expChunks;
 };
 
-std::istream& operator>>(std::istream& stream, BupHeader& header);
+SpanReader& operator>>(SpanReader& stream, BupHeader& header);
 
 struct TxaChunk {
 	uint16_t index;
@@ -96,11 +106,11 @@ struct TxaHeader {
 	uint32_t largestDecodedChunk;
 	uint32_t indexSize;
 	std::vector<TxaChunk> chunks;
-	void write(std::ostream& stream, std::istream& reference) const;
+	void write(std::ostream& stream, ByteSpan reference) const;
 	size_t updateAndCalcBinSize();
 };
 
-std::istream& operator>>(std::istream& stream, TxaHeader& header);
+SpanReader& operator>>(SpanReader& stream, TxaHeader& header);
 
 struct Msk3Header {
 	bool isSwitch;
@@ -109,7 +119,7 @@ struct Msk3Header {
 	uint32_t compressedSize;
 };
 
-std::istream& operator>>(std::istream& stream, Msk3Header& header);
+SpanReader& operator>>(SpanReader& stream, Msk3Header& header);
 
 struct Msk4Header {
 	uint16_t width;
@@ -118,4 +128,4 @@ struct Msk4Header {
 	uint32_t dataSize;
 };
 
-std::istream& operator>>(std::istream& stream, Msk4Header& header);
+SpanReader& operator>>(SpanReader& stream, Msk4Header& header);
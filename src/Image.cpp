@@ -3,6 +3,8 @@ extern "C" {
 #include <png.h>
 }
 #include <cstdio>
+#include <algorithm>
+#include "Utilities.hpp"
 #define throwing_assert(x) if (!(x)) { throw std::runtime_error(std::string("Failed assertion ") + #x); }
 
 void Image::drawOnto(Image &image, Point point, Point sourcePoint, Size section) const {
@@ -20,18 +22,29 @@ void Image::drawOnto(Image &image, Point point, Size section) const {
 	drawOnto(image, point, {0, 0}, section);
 }
 
-void Image::drawOnto(Image &image, Point point, std::vector<MaskRect> sections) const {
+void Image::drawOnto(Image &image, Point point, const std::vector<MaskRect> &sections) const {
 	for (const auto& section : sections) {
 		throwing_assert(section.x2 <= size.width && section.y2 <= size.height);
 		throwing_assert(point.x + section.x2 <= image.size.width && point.y + section.y2 <= image.size.height);
+		if (section.x2 <= section.x1) { continue; }
 		for (int y = section.y1; y < section.y2; y++) {
-			for (int x = section.x1; x < section.x2; x++) {
-				image.pixel(x + point.x, y + point.y) = this->pixel(x, y);
-			}
+			memcpy(&image.pixel(section.x1 + point.x, y + point.y), &this->pixel(section.x1, y), (section.x2 - section.x1) * sizeof(Color));
 		}
 	}
 }
 
+std::vector<MaskRect> offsetMasks(const std::vector<MaskRect> &masks, Point offset) {
+	std::vector<MaskRect> out;
+	out.reserve(masks.size());
+	for (const auto& mask : masks) {
+		out.push_back({
+			static_cast<uint16_t>(mask.x1 + offset.x), static_cast<uint16_t>(mask.y1 + offset.y),
+			static_cast<uint16_t>(mask.x2 + offset.x), static_cast<uint16_t>(mask.y2 + offset.y)
+		});
+	}
+	return out;
+}
+
 Image Image::resizeClampToEdge(Size newSize) const {
 	throwing_assert(size.width > 0 && size.height > 0);
 	Image out(newSize);
@@ -60,84 +73,272 @@ bool Image::operator==(const Image& other) const {
 	return !std::memcmp(colorData.data(), other.colorData.data(), colorData.size() * sizeof(Color));
 }
 
+Size Downscaler::thumbnailSize(Size full, int maxDimension) {
+	if (full.width <= maxDimension && full.height <= maxDimension) {
+		return full;
+	}
+	if (full.width >= full.height) {
+		return {maxDimension, std::max(1, static_cast<int>(static_cast<int64_t>(full.height) * maxDimension / full.width))};
+	} else {
+		return {std::max(1, static_cast<int>(static_cast<int64_t>(full.width) * maxDimension / full.height)), maxDimension};
+	}
+}
+
+Downscaler::Downscaler(Size fullSize, Size thumbSize): Downscaler(fullSize, thumbSize, {0, 0, static_cast<uint16_t>(fullSize.width), static_cast<uint16_t>(fullSize.height)}) {}
+
+Downscaler::Downscaler(Size fullSize, Size thumbSize, MaskRect fullRegion): fullSize(fullSize), thumbSize(thumbSize) {
+	throwing_assert(thumbSize.width <= fullSize.width && thumbSize.height <= fullSize.height);
+	if (fullRegion.x2 <= fullRegion.x1 || fullRegion.y2 <= fullRegion.y1) {
+		area = {0, 0, 0, 0};
+	} else {
+		area.x1 = thumbX(fullRegion.x1);
+		area.y1 = thumbY(fullRegion.y1);
+		area.x2 = thumbX(fullRegion.x2 - 1) + 1;
+		area.y2 = thumbY(fullRegion.y2 - 1) + 1;
+	}
+	sums.resize((area.x2 - area.x1) * (area.y2 - area.y1) * 4);
+}
+
+void Downscaler::add(const Image &img, Point point, const std::vector<MaskRect> &sections) {
+	int areaWidth = area.x2 - area.x1;
+	for (const auto& section : sections) {
+		throwing_assert(section.x2 <= img.size.width && section.y2 <= img.size.height);
+		for (int y = section.y1; y < section.y2; y++) {
+			int ty = thumbY(y + point.y);
+			throwing_assert(ty >= area.y1 && ty < area.y2);
+			uint64_t *row = &sums[(ty - area.y1) * areaWidth * 4];
+			for (int x = section.x1; x < section.x2; x++) {
+				int tx = thumbX(x + point.x);
+				throwing_assert(tx >= area.x1 && tx < area.x2);
+				const Color &c = img.pixel(x, y);
+				uint64_t *px = &row[(tx - area.x1) * 4];
+				px[0] += c.r * c.a;
+				px[1] += c.g * c.a;
+				px[2] += c.b * c.a;
+				px[3] += c.a;
+			}
+		}
+	}
+}
+
+void Downscaler::addTo(Downscaler &other) const {
+	throwing_assert(fullSize == other.fullSize && thumbSize == other.thumbSize);
+	int areaWidth = area.x2 - area.x1;
+	int otherWidth = other.area.x2 - other.area.x1;
+	for (int y = area.y1; y < area.y2; y++) {
+		throwing_assert(y >= other.area.y1 && y < other.area.y2);
+		throwing_assert(area.x1 >= other.area.x1 && area.x2 <= other.area.x2);
+		const uint64_t *src = &sums[(y - area.y1) * areaWidth * 4];
+		uint64_t *dst = &other.sums[((y - other.area.y1) * otherWidth + (area.x1 - other.area.x1)) * 4];
+		for (int i = 0; i < areaWidth * 4; i++) {
+			dst[i] += src[i];
+		}
+	}
+}
+
+Image Downscaler::result() const {
+	Image out({area.x2 - area.x1, area.y2 - area.y1});
+	int areaWidth = area.x2 - area.x1;
+	for (int y = area.y1; y < area.y2; y++) {
+		uint64_t rows = fullY(y + 1) - fullY(y);
+		for (int x = area.x1; x < area.x2; x++) {
+			uint64_t count = rows * (fullX(x + 1) - fullX(x));
+			const uint64_t *px = &sums[((y - area.y1) * areaWidth + (x - area.x1)) * 4];
+			Color &c = out.pixel(x - area.x1, y - area.y1);
+			if (px[3] == 0 || count == 0) {
+				c = Color(0, 0, 0, 0);
+				continue;
+			}
+			c.r = static_cast<uint8_t>((px[0] + px[3] / 2) / px[3]);
+			c.g = static_cast<uint8_t>((px[1] + px[3] / 2) / px[3]);
+			c.b = static_cast<uint8_t>((px[2] + px[3] / 2) / px[3]);
+			c.a = static_cast<uint8_t>((px[3] + count / 2) / count);
+		}
+	}
+	return out;
+}
+
 int Image::writePNG(const fs::path &filename, const std::string &title) const {
 	return ::writePNG(filename, PNGColorType::RGBA, size, reinterpret_cast<const uint8_t *>(colorData.data()), title);
 }
 
-// Based off http://www.labbookpages.co.uk/software/imgProc/libPNG.html
 int writePNG(const fs::path &filename, PNGColorType color, Size size, const uint8_t *data, const std::string &title) {
-	int code = 0;
+	PNGWriter writer(filename, color, size, title);
+	writer.writeRows(data, size.height);
+	return writer.finish() ? 0 : 1;
+}
+
+int writePNG(std::ostream &output, PNGColorType color, Size size, const uint8_t *data, const std::string &title) {
+	PNGWriter writer(output, color, size, title);
+	writer.writeRows(data, size.height);
+	return writer.finish() ? 0 : 1;
+}
+
+std::vector<uint8_t> encodePNG(PNGColorType color, Size size, const uint8_t *data, const std::string &title) {
+	std::vector<uint8_t> out;
+	PNGWriter writer(out, color, size, title);
+	writer.writeRows(data, size.height);
+	if (!writer.finish()) { out.clear(); }
+	return out;
+}
+
+// Based off http://www.labbookpages.co.uk/software/imgProc/libPNG.html
+struct PNGWriter::Impl {
+	FILE *file = NULL;
+	/// Written to instead of `file` if set
+	std::vector<uint8_t> *memory = nullptr;
+	std::ostream *stream = nullptr;
 	png_structp pngPtr = NULL;
 	png_infop infoPtr = NULL;
-	png_bytep row = NULL;
-	png_int_32 pcolor = 0;
 	int pitch = 0;
-
-	switch (color) {
-		case PNGColorType::GRAY: pcolor = PNG_COLOR_TYPE_GRAY; pitch = 1; break;
-		case PNGColorType::RGB:  pcolor = PNG_COLOR_TYPE_RGB;  pitch = 3; break;
-		case PNGColorType::RGBA: pcolor = PNG_COLOR_TYPE_RGBA; pitch = 4; break;
+	int width = 0;
+	int rowsLeft = 0;
+	bool failed = false;
+
+	~Impl() {
+		if (file != NULL) { fclose(file); }
+		if (infoPtr != NULL) { png_free_data(pngPtr, infoPtr, PNG_FREE_ALL, -1); }
+		if (pngPtr != NULL) { png_destroy_write_struct(&pngPtr, (png_infopp)NULL); }
 	}
 
-	FILE *file = FOPEN(filename.c_str(), "wb");
-	if (file == NULL) {
-		fprintf(stderr, "Could not open file %s for writing\n", filename.string().c_str());
-		code = 1;
-		goto finalize;
+	static void writeMemory(png_structp pngPtr, png_bytep data, png_size_t length) {
+		auto *memory = static_cast<std::vector<uint8_t> *>(png_get_io_ptr(pngPtr));
+		memory->insert(memory->end(), data, data + length);
 	}
-
-	pngPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (pngPtr == NULL) {
-		fprintf(stderr, "Could not allocate PNG write struct\n");
-		code = 1;
-		goto finalize;
+	static void flushMemory(png_structp pngPtr) {}
+	static void writeStream(png_structp pngPtr, png_bytep data, png_size_t length) {
+		auto *stream = static_cast<std::ostream *>(png_get_io_ptr(pngPtr));
+		if (!stream->write(reinterpret_cast<const char *>(data), length)) {
+			png_error(pngPtr, "Write failed");
+		}
 	}
-
-	infoPtr = png_create_info_struct(pngPtr);
-	if (infoPtr == NULL) {
-		fprintf(stderr, "Could not allocate PNG info struct\n");
-		code = 1;
-		goto finalize;
+	static void flushStream(png_structp pngPtr) {
+		static_cast<std::ostream *>(png_get_io_ptr(pngPtr))->flush();
 	}
 
-	if (setjmp(png_jmpbuf(pngPtr))) {
-		fprintf(stderr, "Error during PNG creation\n");
-		code = 1;
-		goto finalize;
-	}
+	/// Sets up libpng once the output is open, and writes the header
+	void start(PNGColorType color, Size size, const std::string &title) {
+		png_int_32 pcolor = 0;
 
-	png_init_io(pngPtr, file);
+		switch (color) {
+			case PNGColorType::GRAY: pcolor = PNG_COLOR_TYPE_GRAY; pitch = 1; break;
+			case PNGColorType::RGB:  pcolor = PNG_COLOR_TYPE_RGB;  pitch = 3; break;
+			case PNGColorType::RGBA: pcolor = PNG_COLOR_TYPE_RGBA; pitch = 4; break;
+		}
+		width = size.width;
+		rowsLeft = size.height;
+
+		pngPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		if (pngPtr == NULL) {
+			fprintf(stderr, "Could not allocate PNG write struct\n");
+			failed = true;
+			return;
+		}
+
+		infoPtr = png_create_info_struct(pngPtr);
+		if (infoPtr == NULL) {
+			fprintf(stderr, "Could not allocate PNG info struct\n");
+			failed = true;
+			return;
+		}
+
+		if (setjmp(png_jmpbuf(pngPtr))) {
+			fprintf(stderr, "Error during PNG creation\n");
+			failed = true;
+			return;
+		}
+
+		if (memory) {
+			png_set_write_fn(pngPtr, memory, writeMemory, flushMemory);
+		} else if (stream) {
+			png_set_write_fn(pngPtr, stream, writeStream, flushStream);
+		} else {
+			png_init_io(pngPtr, file);
+		}
 
-	// Write header (8 bit color depth)
-	png_set_IHDR(pngPtr, infoPtr, size.width, size.height, /*bit depth*/ 8, pcolor, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+		// Write header (8 bit color depth)
+		png_set_IHDR(pngPtr, infoPtr, size.width, size.height, /*bit depth*/ 8, pcolor, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
-	if (title.size() > 0) {
-		png_text titleText;
-		titleText.compression = PNG_TEXT_COMPRESSION_NONE;
-		titleText.key = (char *)"Title";
-		titleText.text = (char *)title.c_str();
-		png_set_text(pngPtr, infoPtr, &titleText, 1);
+		if (title.size() > 0) {
+			png_text titleText;
+			titleText.compression = PNG_TEXT_COMPRESSION_NONE;
+			titleText.key = (char *)"Title";
+			titleText.text = (char *)title.c_str();
+			png_set_text(pngPtr, infoPtr, &titleText, 1);
+		}
+
+		png_write_info(pngPtr, infoPtr);
+	}
+};
+
+PNGWriter::PNGWriter(const fs::path &filename, PNGColorType color, Size size, const std::string &title) {
+	impl = new Impl();
+	impl->file = FOPEN(filename.c_str(), "wb");
+	if (impl->file == NULL) {
+		fprintf(stderr, "Could not open file %s for writing\n", filename.string().c_str());
+		impl->failed = true;
+		return;
 	}
+	impl->start(color, size, title);
+}
 
-	png_write_info(pngPtr, infoPtr);
+PNGWriter::PNGWriter(std::vector<uint8_t> &output, PNGColorType color, Size size, const std::string &title) {
+	impl = new Impl();
+	impl->memory = &output;
+	impl->start(color, size, title);
+}
 
-//	row = (png_bytep)malloc(4 * this->size.width * sizeof(png_byte));
+PNGWriter::PNGWriter(std::ostream &output, PNGColorType color, Size size, const std::string &title) {
+	impl = new Impl();
+	impl->stream = &output;
+	impl->start(color, size, title);
+}
+
+PNGWriter::~PNGWriter() {
+	delete impl;
+}
 
-	for (int y = 0; y < size.height; y++) {
-//		for (int x = 0; x < this->size.width; x++) {
-//			*(Color *)&row[x * 4] = this->pixel(x, y);
-//		}
-		png_write_row(pngPtr, &data[y * size.width * pitch]);
+bool PNGWriter::writeRows(const uint8_t *data, int count) {
+	if (impl->failed) { return false; }
+	if (count > impl->rowsLeft) {
+		fprintf(stderr, "Tried to write more rows than the PNG has\n");
+		impl->failed = true;
+		return false;
 	}
+	if (setjmp(png_jmpbuf(impl->pngPtr))) {
+		fprintf(stderr, "Error during PNG creation\n");
+		impl->failed = true;
+		return false;
+	}
+	for (int y = 0; y < count; y++) {
+		png_write_row(impl->pngPtr, &data[y * impl->width * impl->pitch]);
+	}
+	impl->rowsLeft -= count;
+	return true;
+}
 
-	png_write_end(pngPtr, NULL);
+bool PNGWriter::failed() const {
+	return impl->failed;
+}
 
-finalize:
-	if (file != NULL) { fclose(file); }
-	if (infoPtr != NULL) { png_free_data(pngPtr, infoPtr, PNG_FREE_ALL, -1); }
-	if (pngPtr != NULL) { png_destroy_write_struct(&pngPtr, (png_infopp)NULL); }
-	if (row != NULL) { free(row); }
-	return code;
+bool PNGWriter::finish() {
+	if (impl->failed) { return false; }
+	if (impl->rowsLeft != 0) {
+		fprintf(stderr, "PNG finished with %d rows still unwritten\n", impl->rowsLeft);
+		impl->failed = true;
+		return false;
+	}
+	if (setjmp(png_jmpbuf(impl->pngPtr))) {
+		fprintf(stderr, "Error during PNG creation\n");
+		impl->failed = true;
+		return false;
+	}
+	png_write_end(impl->pngPtr, NULL);
+	if (impl->stream && !impl->stream->flush()) {
+		impl->failed = true;
+		return false;
+	}
+	return true;
 }
 
 Image Image::readPNG(const fs::path &filename) {
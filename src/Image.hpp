@@ -3,6 +3,7 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <ostream>
 #include "FS.hpp"
 #include "HeaderStructs.hpp"
 
@@ -60,7 +61,7 @@ struct Image {
 
 	void drawOnto(Image &image, Point point, Point sourcePoint, Size section) const;
 	void drawOnto(Image &image, Point point, Size section) const;
-	void drawOnto(Image &image, Point point, std::vector<MaskRect> sections) const;
+	void drawOnto(Image &image, Point point, const std::vector<MaskRect> &sections) const;
 	/// Resizes the image, copying the right and bottom pixels into the new sections
 	Image resizeClampToEdge(Size newSize) const;
 
@@ -81,5 +82,64 @@ struct Image {
 	bool operator==(const Image& other) const;
 };
 
+/// Moves masks relative to a chunk at `offset` into the coordinate space of the image it's drawn onto
+std::vector<MaskRect> offsetMasks(const std::vector<MaskRect> &masks, Point offset);
+
+/// Area-averages full resolution pixels into a thumbnail
+/// Pixels are accumulated as they're added, so the full resolution image never needs to exist
+/// Each full resolution pixel should be added at most once, pixels never added count as transparent
+class Downscaler {
+	Size fullSize;
+	Size thumbSize;
+	/// Section of the thumbnail this accumulates
+	MaskRect area;
+	/// Premultiplied red, green, blue and alpha sums for each pixel in `area`
+	std::vector<uint64_t> sums;
+
+	int thumbX(int x) const { return static_cast<int>(static_cast<int64_t>(x) * thumbSize.width / fullSize.width); }
+	int thumbY(int y) const { return static_cast<int>(static_cast<int64_t>(y) * thumbSize.height / fullSize.height); }
+	/// First full resolution column / row that lands in the given thumbnail column / row
+	int fullX(int x) const { return static_cast<int>((static_cast<int64_t>(x) * fullSize.width + thumbSize.width - 1) / thumbSize.width); }
+	int fullY(int y) const { return static_cast<int>((static_cast<int64_t>(y) * fullSize.height + thumbSize.height - 1) / thumbSize.height); }
+
+public:
+	/// Size of the thumbnail of an image of size `full` that fits in a `maxDimension` square
+	static Size thumbnailSize(Size full, int maxDimension);
+
+	Downscaler(Size fullSize, Size thumbSize);
+	/// Only accumulates the part of the thumbnail covered by `fullRegion` (in full resolution coordinates)
+	Downscaler(Size fullSize, Size thumbSize, MaskRect fullRegion);
+
+	/// Adds the `sections` of `img` that would be drawn when drawing it at `point`
+	void add(const Image &img, Point point, const std::vector<MaskRect> &sections);
+	/// Adds everything accumulated here to `other`, which must be for the same sizes
+	void addTo(Downscaler &other) const;
+	Image result() const;
+};
+
 enum class PNGColorType { GRAY, RGB, RGBA };
 int writePNG(const fs::path &filename, PNGColorType color, Size size, const uint8_t *data, const std::string &title = "");
+int writePNG(std::ostream &output, PNGColorType color, Size size, const uint8_t *data, const std::string &title = "");
+/// Returns the PNG file's bytes, or nothing if encoding failed
+std::vector<uint8_t> encodePNG(PNGColorType color, Size size, const uint8_t *data, const std::string &title = "");
+
+/// Writes a PNG a few rows at a time, for images that are never fully in memory
+class PNGWriter {
+	struct Impl;
+	Impl* impl;
+
+public:
+	PNGWriter(const PNGWriter&) = delete;
+	PNGWriter(const fs::path &filename, PNGColorType color, Size size, const std::string &title = "");
+	/// Writes to `output` instead of a file, `output` must outlive the writer
+	PNGWriter(std::ostream &output, PNGColorType color, Size size, const std::string &title = "");
+	/// Appends the PNG to `output` instead of writing a file, `output` must outlive the writer
+	PNGWriter(std::vector<uint8_t> &output, PNGColorType color, Size size, const std::string &title = "");
+	~PNGWriter();
+	/// Writes the next `count` rows, returns false if anything has failed so far
+	bool writeRows(const uint8_t *data, int count);
+	/// Finishes the file, returns false if anything has failed
+	bool finish();
+	/// Whether anything has failed so far, e.g. the file couldn't be opened
+	bool failed() const;
+};
@@ -0,0 +1,121 @@
+#include "MappedFile.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+#ifdef _WIN32
+#  define NOMINMAX
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#  include <fcntl.h>
+#  include <io.h>
+#else
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+struct MappedFile::Impl {
+	/// Used when the file can't be mapped (e.g. it's a pipe)
+	std::vector<uint8_t> buffer;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+	const void *view = nullptr;
+	~Impl() {
+		if (view) { UnmapViewOfFile(view); }
+		if (mapping) { CloseHandle(mapping); }
+		if (file != INVALID_HANDLE_VALUE) { CloseHandle(file); }
+	}
+#else
+	void *view = nullptr;
+	size_t viewSize = 0;
+	~Impl() {
+		if (view) { munmap(view, viewSize); }
+	}
+#endif
+
+	/// Returns the mapped span, or an empty span with `view` unset if mapping isn't possible
+	ByteSpan map(const fs::path &path) {
+#ifdef _WIN32
+		file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) { return ByteSpan(); }
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) { return ByteSpan(); }
+		mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!mapping) { return ByteSpan(); }
+		view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!view) { return ByteSpan(); }
+		return ByteSpan(static_cast<const uint8_t *>(view), static_cast<size_t>(size.QuadPart));
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) { return ByteSpan(); }
+		struct stat st;
+		if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+			close(fd);
+			return ByteSpan();
+		}
+		void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (ptr == MAP_FAILED) { return ByteSpan(); }
+		view = ptr;
+		viewSize = st.st_size;
+		return ByteSpan(static_cast<const uint8_t *>(view), viewSize);
+#endif
+	}
+};
+
+MappedFile::MappedFile(const fs::path &path) {
+	impl = new Impl();
+	span = impl->map(path);
+	if (impl->view) { return; }
+
+	fs::ifstream in(path, std::ios::binary);
+	if (!in) {
+		delete impl;
+		throw std::runtime_error("Failed to open file " + path.string());
+	}
+	impl->buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	span = ByteSpan(impl->buffer.data(), impl->buffer.size());
+}
+
+void MappedFile::prefetch() const {
+#ifndef _WIN32
+	if (impl->view) {
+		madvise(impl->view, impl->viewSize, MADV_WILLNEED);
+	}
+#endif
+	// The hint is only a hint, touching a byte of every page makes sure the reads happen here
+	volatile uint8_t sink = 0;
+	for (size_t i = 0; i < span.size(); i += 4096) {
+		sink ^= span.data()[i];
+	}
+	(void)sink;
+}
+
+MappedFile MappedFile::readStdin() {
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	MappedFile out;
+	out.impl = new Impl();
+	auto &buffer = out.impl->buffer;
+	size_t used = 0;
+	do {
+		buffer.resize(std::max<size_t>(buffer.size() * 2, 1 << 16));
+		used += fread(buffer.data() + used, 1, buffer.size() - used, stdin);
+	} while (used == buffer.size());
+	if (ferror(stdin)) {
+		throw std::runtime_error("Failed to read stdin");
+	}
+	buffer.resize(used);
+	out.span = ByteSpan(buffer.data(), buffer.size());
+	return out;
+}
+
+MappedFile::~MappedFile() {
+	delete impl;
+}
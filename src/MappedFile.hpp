@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "ByteSpan.hpp"
+#include "FS.hpp"
+
+/// Read-only view of a whole input file, memory mapped where possible
+class MappedFile {
+	struct Impl;
+	Impl* impl;
+	ByteSpan span;
+	MappedFile(): impl(nullptr) {}
+
+public:
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile(MappedFile&& other): impl(other.impl), span(other.span) { other.impl = nullptr; other.span = ByteSpan(); }
+	/// Throws if the file can't be opened
+	explicit MappedFile(const fs::path &path);
+	/// Reads all of stdin into memory, since decoding needs random access
+	static MappedFile readStdin();
+	~MappedFile();
+
+	ByteSpan data() const { return span; }
+	/// Reads the whole file into memory now, so later accesses don't stall on page faults
+	void prefetch() const;
+};
@@ -2,20 +2,23 @@
 
 #include <stdint.h>
 
+#include <boost/endian/buffers.hpp>
+
 #include "Config.hpp"
 #include "HeaderStructs.hpp"
 #include "Decompression.hpp"
+#include "Utilities.hpp"
 
-int processMsk3(std::istream &in, const fs::path &output) {
+static std::vector<uint8_t> decodeMsk3(const ConversionContext &ctx, ByteSpan in, Size &size) {
+	SpanReader reader(ctx, in);
 	Msk3Header header;
-	in >> header;
-	Size size { header.width, header.height };
+	reader >> header;
+	size = { header.width, header.height };
 
-	std::vector<uint8_t> compressedData, decompressedData;
-	compressedData.resize(header.compressedSize);
-	in.read((char *)compressedData.data(), compressedData.size());
+	std::vector<uint8_t> decompressedData;
+	ByteSpan compressedData = reader.readSpan(header.compressedSize);
 
-	if (!decompressHigu(decompressedData, compressedData.data(), (int)compressedData.size(), header.isSwitch)) {
+	if (!decompressHigu(decompressedData, compressedData.data(), compressedData.size(), header.isSwitch)) {
 		throw std::runtime_error("Decompression failed");
 	}
 
@@ -23,33 +26,56 @@ int processMsk3(std::istream &in, const fs::path &output) {
 		throw std::runtime_error("Expected " + std::to_string(size.area()) + " bytes but got " + std::to_string(decompressedData.size()) + " bytes");
 	}
 
-	writePNG(output, PNGColorType::GRAY, size, decompressedData.data());
-
-	return 0;
+	return decompressedData;
 }
 
-int processMsk4(std::istream &in, const fs::path &output) {
+static std::vector<uint8_t> decodeMsk4(const ConversionContext &ctx, ByteSpan in, Size &size) {
+	SpanReader reader(ctx, in);
 	Msk4Header header;
-	in >> header;
-	Size size { header.width, header.height };
+	reader >> header;
+	size = { header.width, header.height };
 
-	std::vector<uint8_t> compressedData, decompressedData;
+	std::vector<uint8_t> decompressedData;
+	if (header.dataSize < 4) {
+		throw std::runtime_error("MSK4 data section is too small");
+	}
 	// First thing in data is its size (uint32)
-	compressedData.resize(header.dataSize - 4);
-	in.seekg(header.dataOffset + 4, in.beg);
-	in.read((char *)compressedData.data(), compressedData.size());
+	recordCoverage(&ctx, in.subspan(header.dataOffset, header.dataSize));
+	ByteSpan compressedData = in.subspan(header.dataOffset + 4, header.dataSize - 4);
 
 	// TODO: Figure out what the stuff between the header and data is
 
-	if (!decompressHigu(decompressedData, compressedData.data(), (int)compressedData.size(), true)) {
+	if (!decompressHigu(decompressedData, compressedData.data(), compressedData.size(), true)) {
 		throw std::runtime_error("Decompression failed");
 	}
 
 	if (decompressedData.size() != size.area()) {
-		throw std::runtime_error("Expected " + std::to_string(size.area()) + " bytes but got " + std::to_string(decompressedData.size()) + " bytes when processing " + currentFileName.string());
+		throw std::runtime_error("Expected " + std::to_string(size.area()) + " bytes but got " + std::to_string(decompressedData.size()) + " bytes when processing " + ctx.fileName.string());
 	}
 
-	writePNG(output, PNGColorType::GRAY, size, decompressedData.data());
+	return decompressedData;
+}
+
+std::vector<uint8_t> decodeMsk(const ConversionContext &ctx, ByteSpan in, Size &size) {
+	boost::endian::big_int32_buf_t magic;
+	SpanReader(in).read(&magic, 4);
+	switch (magic.value()) {
+		case 'MSK3': return decodeMsk3(ctx, in, size);
+		case 'MSK4': return decodeMsk4(ctx, in, size);
+	}
+	throw std::runtime_error("Expected an MSK3 or MSK4 file");
+}
+
+int processMsk3(const ConversionContext &ctx, ByteSpan in, const fs::path &output) {
+	Size size;
+	std::vector<uint8_t> data = decodeMsk3(ctx, in, size);
+	saveImage(ctx, output, PNGColorType::GRAY, size, data.data());
+	return 0;
+}
 
+int processMsk4(const ConversionContext &ctx, ByteSpan in, const fs::path &output) {
+	Size size;
+	std::vector<uint8_t> data = decodeMsk4(ctx, in, size);
+	saveImage(ctx, output, PNGColorType::GRAY, size, data.data());
 	return 0;
 }
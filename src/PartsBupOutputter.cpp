@@ -2,6 +2,9 @@
 
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+
+#include "Utilities.hpp"
 
 class PartsBupOutputter: public BupOutputter {
 	fs::path basePath;
@@ -12,8 +15,9 @@ class PartsBupOutputter: public BupOutputter {
 	Point facePos = {0, 0};
 	Point mouthPos = {0, 0};
 	Image base;
+	/// Base with the current face drawn on, restored from `base` for each new face
 	Image withFace;
-	Image tmp;
+	std::vector<MaskRect> faceDirty;
 
 	enum class Blend {
 		/// Images can be composited using normal alpha blending
@@ -34,21 +38,43 @@ class PartsBupOutputter: public BupOutputter {
 	std::vector<std::pair<std::string, std::vector<ImageEntry>>> expressions;
 
 public:
+	using BupOutputter::BupOutputter;
 	void setBase(fs::path basePath, Image img, std::string name) override {
 		partsPath = basePath/name;
 		fs::create_directory(partsPath);
-		img.writePNG(partsPath/fs::u8path(name + ".png"));
+		save(img, partsPath/fs::u8path(name + ".png"));
 		this->basePath = std::move(basePath);
 		baseName = std::move(name);
 		base = std::move(img);
+		withFace = base;
+		faceDirty.clear();
 	}
 
-	Blend prepareImageInTmp(const Image& img, Point pos, const std::vector<MaskRect>& mask, const Image& target) {
-		tmp.fastResize(img.size);
-		std::fill(tmp.colorData.begin(), tmp.colorData.end(), Color());
+	void save(Image img, fs::path path) {
+		saveImage(ctx, std::move(img), std::move(path));
+	}
+
+	/// Copies the masked sections of `img` into `part`, cropped to the bounding box of the masks
+	/// `pos` is moved to the location of the cropped part
+	Blend preparePart(Image& part, const Image& img, Point& pos, const std::vector<MaskRect>& mask, const Image& target) {
+		MaskRect bounds = {UINT16_MAX, UINT16_MAX, 0, 0};
+		for (const auto& section : mask) {
+			if (section.x1 >= section.x2 || section.y1 >= section.y2) { continue; }
+			bounds.x1 = std::min(bounds.x1, section.x1);
+			bounds.y1 = std::min(bounds.y1, section.y1);
+			bounds.x2 = std::max(bounds.x2, section.x2);
+			bounds.y2 = std::max(bounds.y2, section.y2);
+		}
+		if (bounds.x1 >= bounds.x2) {
+			// Nothing visible, but still output an image so the JSON stays valid
+			part = Image({1, 1});
+			return Blend::AlphaBlend;
+		}
+
+		part = Image({bounds.x2 - bounds.x1, bounds.y2 - bounds.y1});
 		bool hasPartiallyTransparent = false;
 		bool hasFullyTransparent = false;
-		img.drawOnto(tmp, {0, 0}, mask);
+		img.drawOnto(part, {-bounds.x1, -bounds.y1}, mask);
 		for (const auto& section : mask) {
 			for (int y = section.y1; y < section.y2; y++) {
 				for (int x = section.x1; x < section.x2; x++) {
@@ -65,13 +91,16 @@ public:
 				}
 			}
 		}
+		pos.x += bounds.x1;
+		pos.y += bounds.y1;
 		return hasFullyTransparent ? Blend::NotPossible
 		     : hasPartiallyTransparent ? Blend::CustomBlend
 		     : Blend::AlphaBlend;
 	}
 
 	void newFace(const Image& img, Point pos, const std::string &name, const std::vector<MaskRect>& mask) override {
-		withFace = base;
+		base.drawOnto(withFace, {0, 0}, faceDirty);
+		faceDirty.clear();
 		withMouthName = "";
 		mouthBlend = Blend::AlphaBlend;
 		facePos = pos;
@@ -81,9 +110,11 @@ public:
 		}
 		else {
 			img.drawOnto(withFace, pos, mask);
+			faceDirty = offsetMasks(mask, pos);
 			withFaceName = baseName + "_" + name;
-			faceBlend = prepareImageInTmp(img, pos, mask, base);
-			tmp.writePNG(partsPath/fs::u8path(withFaceName + ".png"));
+			Image part;
+			faceBlend = preparePart(part, img, facePos, mask, base);
+			save(std::move(part), partsPath/fs::u8path(withFaceName + ".png"));
 		}
 		expressions.push_back({name, {}});
 	}
@@ -91,8 +122,9 @@ public:
 	void newMouth(const Image& img, Point pos, int num, const std::vector<MaskRect>& mask) override {
 		withMouthName = (withFaceName.empty() ? baseName : withFaceName) + "_" + std::to_string(num);
 		mouthPos = pos;
-		mouthBlend = prepareImageInTmp(img, pos, mask, withFace);
-		tmp.writePNG(partsPath/fs::u8path(withMouthName + ".png"));
+		Image part;
+		mouthBlend = preparePart(part, img, mouthPos, mask, withFace);
+		save(std::move(part), partsPath/fs::u8path(withMouthName + ".png"));
 	}
 
 	void write() override {
@@ -126,6 +158,7 @@ public:
 
 	void writeJSON() {
 		fs::path name = basePath/fs::u8path(baseName + ".json");
+		ctx.recordOutput(name);
 		// When you didn't bother to import a json library
 		// Hopefully no one puts weird characters in their expression names
 #ifdef USE_BOOST_FS
@@ -181,6 +214,6 @@ public:
 	}
 };
 
-std::unique_ptr<BupOutputter> BupOutputter::makeParts() {
-	return std::make_unique<PartsBupOutputter>();
+std::unique_ptr<BupOutputter> BupOutputter::makeParts(const ConversionContext &ctx) {
+	return std::make_unique<PartsBupOutputter>(ctx);
 }
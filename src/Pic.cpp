@@ -1,29 +1,388 @@
 #include "FileTypes.hpp"
 
 #include <stdint.h>
+#include <fstream>
 #include <unordered_map>
 #include <algorithm>
+#include <exception>
+#include <memory>
+#include <queue>
 
 #include "Config.hpp"
 #include "FS.hpp"
 #include "HeaderStructs.hpp"
+#include "MappedFile.hpp"
 #include "Decompression.hpp"
+#include "Utilities.hpp"
 
-int processPic(std::istream &in, const fs::path &output) {
-	PicHeader header;
-	in >> header;
+namespace {
+
+/// Where each chunk of a pic gets drawn
+struct PicLayout {
+	/// Masks of each chunk, in the coordinates of the full image
+	std::vector<std::vector<MaskRect>> destMasks;
+	/// Earlier chunks that each chunk overlaps, and so must be drawn after
+	std::vector<std::vector<size_t>> dependencies;
+	PicLayout(const ConversionContext &ctx, const PicHeader &header, ByteSpan file);
+};
 
-	Image result({header.width, header.height}), currentChunk({0, 0});
+PicLayout::PicLayout(const ConversionContext &ctx, const PicHeader &header, ByteSpan file): destMasks(header.chunks.size()), dependencies(header.chunks.size()) {
+	for (size_t i = 0; i < header.chunks.size(); i++) {
+		const auto &chunk = header.chunks[i];
+		SpanReader reader(ctx, file, chunk.offset);
+		ChunkHeader chunkHeader;
+		reader >> chunkHeader;
+		chunkHeader.masks.insert(chunkHeader.masks.end(), chunkHeader.transparentMasks.begin(), chunkHeader.transparentMasks.end());
+		destMasks[i] = offsetMasks(chunkHeader.masks, {chunk.x, chunk.y});
+		for (size_t j = 0; j < i; j++) {
+			bool overlaps = std::any_of(destMasks[i].begin(), destMasks[i].end(), [&](const MaskRect &a) {
+				return std::any_of(destMasks[j].begin(), destMasks[j].end(), [&](const MaskRect &b) { return a.intersects(b); });
+			});
+			if (overlaps) {
+				dependencies[i].push_back(j);
+			}
+		}
+	}
+}
+
+struct PicWorkerState {
+	Image currentChunk;
 	std::vector<MaskRect> maskData;
+};
 
-	for(size_t i = 0; i < header.chunks.size(); i++) {
+/// Decodes `header.chunks[indices[k]]` for each `k` on parallel_for workers, then calls `use(k, state)` on the same worker
+/// `state` is null if the chunk failed to decode, and `use(k, nullptr)` also follows a `use(k, state)` that threw,
+/// so every chunk gets its null call to mark it done.  The first error is rethrown once all chunks are done
+template <typename Fn>
+void decodeChunks(const ConversionContext &ctx, const PicHeader &header, ByteSpan file, const std::vector<size_t> &indices, Fn &&use) {
+	std::exception_ptr error;
+#if ENABLE_MULTITHREADED
+	std::mutex mtx;
+#endif
+	auto recordError = [&]{
+#if ENABLE_MULTITHREADED
+		std::lock_guard<std::mutex> l(mtx);
+#endif
+		if (!error) { error = std::current_exception(); }
+	};
+	parallel_for(0, indices.size(), [&]{ return std::make_unique<PicWorkerState>(); }, [&](std::unique_ptr<PicWorkerState> &state, size_t k) {
+		size_t i = indices[k];
+		try {
+			processChunk(ctx, state->currentChunk, state->maskData, header.chunks[i].offset, file, "chunk" + std::to_string(i), header.isSwitch);
+			use(k, state.get());
+			return;
+		} catch (...) {
+			recordError();
+		}
+		use(k, nullptr);
+	});
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+/// Removes `cut` from the area covered by `rects`
+void subtractRect(std::vector<MaskRect> &rects, MaskRect cut) {
+	std::vector<MaskRect> out;
+	for (const auto &r : rects) {
+		if (!r.intersects(cut)) {
+			out.push_back(r);
+			continue;
+		}
+		uint16_t midTop = std::max(r.y1, cut.y1);
+		uint16_t midBottom = std::min(r.y2, cut.y2);
+		if (r.y1 < cut.y1) { out.push_back({r.x1, r.y1, r.x2, cut.y1}); }
+		if (cut.y2 < r.y2) { out.push_back({r.x1, cut.y2, r.x2, r.y2}); }
+		if (r.x1 < cut.x1) { out.push_back({r.x1, midTop, cut.x1, midBottom}); }
+		if (cut.x2 < r.x2) { out.push_back({cut.x2, midTop, r.x2, midBottom}); }
+	}
+	rects = std::move(out);
+}
+
+/// Decodes straight into a thumbnail, each chunk only contributes the pixels no later chunk draws over
+int processPicThumbnail(const ConversionContext &ctx, const PicHeader &header, ByteSpan file, const fs::path &output, int maxDimension) {
+	PicLayout layout(ctx, header, file);
+	Size fullSize = {header.width, header.height};
+	Size thumbSize = Downscaler::thumbnailSize(fullSize, maxDimension);
+
+	// Sections of each chunk that end up visible, in image coordinates
+	std::vector<std::vector<MaskRect>> visible(header.chunks.size());
+	for (size_t i = 0; i < header.chunks.size(); i++) {
+		const auto &masks = layout.destMasks[i];
+		for (size_t m = 0; m < masks.size(); m++) {
+			std::vector<MaskRect> pieces = {masks[m]};
+			for (size_t n = m + 1; n < masks.size(); n++) {
+				subtractRect(pieces, masks[n]);
+			}
+			for (size_t j = i + 1; j < header.chunks.size() && !pieces.empty(); j++) {
+				for (const auto &later : layout.destMasks[j]) {
+					subtractRect(pieces, later);
+				}
+			}
+			visible[i].insert(visible[i].end(), pieces.begin(), pieces.end());
+		}
+	}
+
+	std::vector<size_t> indices;
+	for (size_t i = 0; i < header.chunks.size(); i++) {
+		if (!visible[i].empty()) { indices.push_back(i); }
+	}
+
+	Downscaler thumbnail(fullSize, thumbSize);
+#if ENABLE_MULTITHREADED
+	std::mutex mtx;
+#endif
+	// Visible sections never overlap, so chunks can be added in any order
+	decodeChunks(ctx, header, file, indices, [&](size_t k, PicWorkerState *state) {
+		if (!state) { return; }
+		size_t i = indices[k];
 		const auto &chunk = header.chunks[i];
-		processChunk(currentChunk, maskData, chunk.offset, in, "chunk" + std::to_string(i), header.isSwitch);
-		currentChunk.drawOnto(result, {chunk.x, chunk.y}, maskData);
+		MaskRect bounds = visible[i][0];
+		for (const auto &rect : visible[i]) {
+			bounds = {std::min(bounds.x1, rect.x1), std::min(bounds.y1, rect.y1), std::max(bounds.x2, rect.x2), std::max(bounds.y2, rect.y2)};
+		}
+		Point pos = {chunk.x, chunk.y};
+		Downscaler local(fullSize, thumbSize, bounds);
+		local.add(state->currentChunk, pos, offsetMasks(visible[i], {-pos.x, -pos.y}));
+#if ENABLE_MULTITHREADED
+		std::lock_guard<std::mutex> l(mtx);
+#endif
+		local.addTo(thumbnail);
+	});
+
+	return saveImage(ctx, thumbnail.result(), output);
+}
+
+/// Decodes one band of tiles at a time, writing rows out as soon as no remaining chunk can touch them
+int processPicStreaming(const ConversionContext &ctx, const PicHeader &header, ByteSpan file, const fs::path &output) {
+	PicLayout layout(ctx, header, file);
+	size_t count = header.chunks.size();
+	std::vector<int> top(count, header.height), bottom(count, 0);
+	for (size_t i = 0; i < count; i++) {
+		for (const auto &mask : layout.destMasks[i]) {
+			if (mask.y1 >= mask.y2) { continue; }
+			top[i] = std::min<int>(top[i], mask.y1);
+			bottom[i] = std::max<int>(bottom[i], mask.y2);
+		}
+		if (top[i] >= bottom[i]) {
+			// Draws nothing
+			top[i] = bottom[i] = header.height;
+		}
 	}
 
-	result.writePNG(output);
-	return 0;
+	// Draw topmost chunks first, but never before an earlier chunk they overlap
+	std::vector<size_t> order;
+	std::vector<size_t> waitingOn(count);
+	std::vector<std::vector<size_t>> dependents(count);
+	for (size_t i = 0; i < count; i++) {
+		waitingOn[i] = layout.dependencies[i].size();
+		for (size_t j : layout.dependencies[i]) {
+			dependents[j].push_back(i);
+		}
+	}
+	typedef std::pair<int, size_t> Entry;
+	std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> ready;
+	for (size_t i = 0; i < count; i++) {
+		if (waitingOn[i] == 0) { ready.push({top[i], i}); }
+	}
+	while (!ready.empty()) {
+		size_t i = ready.top().second;
+		ready.pop();
+		order.push_back(i);
+		for (size_t d : dependents[i]) {
+			if (--waitingOn[d] == 0) { ready.push({top[d], d}); }
+		}
+	}
+
+	// Rows above finishedAbove[k] won't be touched by order[k] or anything after it
+	std::vector<int> finishedAbove(count + 1, header.height);
+	for (size_t k = count; k-- > 0;) {
+		finishedAbove[k] = std::min(top[order[k]], finishedAbove[k + 1]);
+	}
+
+	std::unique_ptr<PNGWriter> writerStorage;
+	if (ctx.outputStream) {
+		writerStorage = std::make_unique<PNGWriter>(*ctx.outputStream, PNGColorType::RGBA, Size{header.width, header.height});
+	} else {
+		ctx.recordOutput(output);
+		writerStorage = std::make_unique<PNGWriter>(output, PNGColorType::RGBA, Size{header.width, header.height});
+	}
+	PNGWriter &writer = *writerStorage;
+	// Don't decode the whole image just to throw it away
+	if (writer.failed()) { return EXIT_FAILURE; }
+	// Holds rows [windowTop, windowTop + window.size.height) of the image
+	Image window({header.width, 0});
+	int windowTop = 0;
+	auto growWindow = [&](int end) {
+		if (end - windowTop > window.size.height) {
+			window.size.height = end - windowTop;
+			window.colorData.resize(window.size.area());
+		}
+	};
+	auto flushWindow = [&](int end) {
+		int rows = end - windowTop;
+		if (rows <= 0) { return; }
+		growWindow(end);
+		writer.writeRows(reinterpret_cast<const uint8_t *>(window.colorData.data()), rows);
+		window.colorData.erase(window.colorData.begin(), window.colorData.begin() + rows * window.size.width);
+		window.size.height -= rows;
+		windowTop = end;
+	};
+
+	std::vector<size_t> band;
+	std::vector<Image> bandChunks;
+	std::vector<std::vector<MaskRect>> bandMasks;
+	for (size_t start = 0; start < count;) {
+		size_t end = start + 1;
+		while (end < count && top[order[end]] == top[order[start]]) { end++; }
+		band.assign(order.begin() + start, order.begin() + end);
+		bandChunks.resize(band.size());
+		bandMasks.resize(band.size());
+
+		decodeChunks(ctx, header, file, band, [&](size_t k, PicWorkerState *state) {
+			if (!state) { return; }
+			std::swap(bandChunks[k], state->currentChunk);
+			std::swap(bandMasks[k], state->maskData);
+		});
+
+		for (size_t k = 0; k < band.size(); k++) {
+			const auto &chunk = header.chunks[band[k]];
+			growWindow(bottom[band[k]]);
+			bandChunks[k].drawOnto(window, {chunk.x, chunk.y - windowTop}, bandMasks[k]);
+		}
+		flushWindow(finishedAbove[end]);
+		start = end;
+	}
+	flushWindow(header.height);
+
+	return writer.finish() ? 0 : 1;
+}
+
+}
+
+/// Clips chunk-local `masks` of a chunk at `pos` to `region`, which is in image coordinates
+static std::vector<MaskRect> clipMasks(const std::vector<MaskRect> &masks, Point pos, MaskRect region) {
+	std::vector<MaskRect> out;
+	for (const auto &mask : masks) {
+		MaskRect clipped = {
+			static_cast<uint16_t>(std::max<int>(mask.x1, region.x1 - pos.x)), static_cast<uint16_t>(std::max<int>(mask.y1, region.y1 - pos.y)),
+			static_cast<uint16_t>(std::min<int>(mask.x2, region.x2 - pos.x)), static_cast<uint16_t>(std::min<int>(mask.y2, region.y2 - pos.y))
+		};
+		if (clipped.x1 < clipped.x2 && clipped.y1 < clipped.y2) {
+			out.push_back(clipped);
+		}
+	}
+	return out;
+}
+
+/// Decodes the part of a pic inside `region`, only decompressing the chunks that intersect it
+static Image decodePicRegion(const ConversionContext &ctx, const PicHeader &header, ByteSpan file, MaskRect region) {
+	PicLayout layout(ctx, header, file);
+	Image result({region.x2 - region.x1, region.y2 - region.y1});
+	std::vector<size_t> indices;
+	// Chunks outside the region count as already drawn so nothing waits on them
+	std::vector<char> drawn(header.chunks.size(), true);
+	for (size_t i = 0; i < header.chunks.size(); i++) {
+		const auto &masks = layout.destMasks[i];
+		if (std::any_of(masks.begin(), masks.end(), [&](const MaskRect &mask){ return mask.intersects(region); })) {
+			indices.push_back(i);
+			drawn[i] = false;
+		}
+	}
+#if ENABLE_MULTITHREADED
+	std::mutex mtx;
+	std::condition_variable cv;
+#endif
+
+	// Chunks can be decoded in any order, but where their masks overlap they must be drawn in file order
+	// Workers claim chunks in order, so any chunk being waited on is already being worked on
+	decodeChunks(ctx, header, file, indices, [&](size_t k, PicWorkerState *state) {
+		size_t i = indices[k];
+		const auto &chunk = header.chunks[i];
+		if (state) {
+			// Fail before waiting on anything rather than partway through drawOnto
+			Size chunkSize = state->currentChunk.size;
+			if (std::any_of(state->maskData.begin(), state->maskData.end(), [&](const MaskRect &mask){ return mask.x2 > chunkSize.width || mask.y2 > chunkSize.height; })) {
+				throw std::runtime_error("Mask of chunk" + std::to_string(i) + " is bigger than the chunk");
+			}
+			auto masks = clipMasks(state->maskData, {chunk.x, chunk.y}, region);
+#if ENABLE_MULTITHREADED
+			std::unique_lock<std::mutex> l(mtx);
+			cv.wait(l, [&]{ return std::all_of(layout.dependencies[i].begin(), layout.dependencies[i].end(), [&](size_t j){ return drawn[j]; }); });
+			l.unlock();
+#endif
+			state->currentChunk.drawOnto(result, {chunk.x - region.x1, chunk.y - region.y1}, masks);
+		}
+		{
+#if ENABLE_MULTITHREADED
+			std::lock_guard<std::mutex> l(mtx);
+#endif
+			drawn[i] = true;
+		}
+#if ENABLE_MULTITHREADED
+		cv.notify_all();
+#endif
+	});
+
+	return result;
+}
+
+int processPic(const ConversionContext &ctx, ByteSpan in, const fs::path &output) {
+	SpanReader reader(ctx, in);
+	PicHeader header;
+	reader >> header;
+
+	if (ctx.thumbnailSize > 0) {
+		return processPicThumbnail(ctx, header, in, output, ctx.thumbnailSize);
+	}
+	if (ctx.streamPic) {
+		return processPicStreaming(ctx, header, in, output);
+	}
+
+	MaskRect all = {0, 0, header.width, header.height};
+	return saveImage(ctx, decodePicRegion(ctx, header, in, all), output);
+}
+
+int processPicRegion(const ConversionContext &ctx, ByteSpan in, const fs::path &output, Point position, Size size) {
+	SpanReader reader(ctx, in);
+	PicHeader header;
+	reader >> header;
+
+	MaskRect region = {
+		static_cast<uint16_t>(std::max(0, std::min<int>(position.x, header.width))),
+		static_cast<uint16_t>(std::max(0, std::min<int>(position.y, header.height))),
+		static_cast<uint16_t>(std::max(0, std::min<int>(position.x + size.width, header.width))),
+		static_cast<uint16_t>(std::max(0, std::min<int>(position.y + size.height, header.height))),
+	};
+	if (region.x1 >= region.x2 || region.y1 >= region.y2) {
+		std::cerr << "Crop region doesn't intersect the " << header.width << "x" << header.height << " image" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return saveImage(ctx, decodePicRegion(ctx, header, in, region), output);
+}
+
+int processPicWithMask(const ConversionContext &ctx, ByteSpan in, const fs::path &output, const fs::path &maskFile) {
+	Size maskSize;
+	// The mask is a different file, so it gets its own name in messages and doesn't count towards the pic's coverage
+	ConversionContext maskCtx;
+	maskCtx.fileName = maskFile;
+	std::vector<uint8_t> mask = decodeMsk(maskCtx, MappedFile(maskFile).data(), maskSize);
+
+	SpanReader reader(ctx, in);
+	PicHeader header;
+	reader >> header;
+	if (maskSize != Size{header.width, header.height}) {
+		std::cerr << "Mask is " << maskSize.width << "x" << maskSize.height << " but the pic is " << header.width << "x" << header.height << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	MaskRect all = {0, 0, header.width, header.height};
+	Image result = decodePicRegion(ctx, header, in, all);
+	for (size_t i = 0; i < result.colorData.size(); i++) {
+		result.colorData[i].a = mask[i];
+	}
+	return saveImage(ctx, std::move(result), output);
 }
 
 struct image_hash {
@@ -81,9 +440,10 @@ rightfound:
 	}
 }
 
-int replacePic(std::istream &in, std::ostream &output, const fs::path &replacementFile) {
+int replacePic(const ConversionContext &ctx, ByteSpan in, std::ostream &output, const fs::path &replacementFile) {
+	SpanReader reader(ctx, in);
 	PicHeader header;
-	in >> header;
+	reader >> header;
 
 	int CHUNK_WIDTH = 1024;
 	int CHUNK_HEIGHT = 1024;
@@ -97,7 +457,7 @@ int replacePic(std::istream &in, std::ostream &output, const fs::path &replaceme
 		}
 	}
 
-	printf("Using %dx%d chunks\n", CHUNK_WIDTH, CHUNK_HEIGHT);
+	fprintf(stderr, "Using %dx%d chunks\n", CHUNK_WIDTH, CHUNK_HEIGHT);
 
 	std::unordered_map<Image, std::pair<uint32_t, uint32_t>, image_hash> seen;
 
@@ -151,7 +511,7 @@ int replacePic(std::istream &in, std::ostream &output, const fs::path &replaceme
 	header.filesize = pos;
 	header.write(output, in);
 	for (auto& chunk : data) {
-		output.seekp(chunk.offset, output.beg);
+		seekpZeroFilled(output, chunk.offset);
 		output << chunk.header;
 		output.write(reinterpret_cast<char*>(chunk.data.data()), chunk.data.size());
 	}
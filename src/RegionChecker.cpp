@@ -1,50 +1,62 @@
 #include "RegionChecker.hpp"
+#include <algorithm>
 #include <iostream>
 
-RegionChecker::RegionChecker(std::istream &file) {
-	file.seekg(0, file.beg);
-	std::istreambuf_iterator<char> iter(file);
-	while (iter != std::istreambuf_iterator<char>()) {
-		fileUsage.push_back(*iter != 0);
-		iter++;
+void recordCoverage(const ConversionContext *context, ByteSpan span) {
+	if (context && context->coverage) {
+		context->coverage->add(span);
 	}
-	file.seekg(0, file.beg);
-	usedBits = std::vector<bool>(fileUsage.size());
 }
 
+RegionChecker::RegionChecker(ByteSpan file): file(file) {}
+
 void RegionChecker::add(size_t from, size_t to) {
-	for (size_t i = from; i < to; i++) {
-		usedBits[i] = true;
+	if (from >= to) { return; }
+#if ENABLE_MULTITHREADED
+	std::lock_guard<std::mutex> lock(mtx);
+#endif
+	// Merge with every range that overlaps or touches [from, to)
+	auto it = used.upper_bound(from);
+	if (it != used.begin() && std::prev(it)->second >= from) {
+		--it;
+		from = it->first;
+		to = std::max(to, it->second);
+		it = used.erase(it);
+	}
+	while (it != used.end() && it->first <= to) {
+		to = std::max(to, it->second);
+		it = used.erase(it);
 	}
+	used.emplace_hint(it, from, to);
+}
 
-	std::cout << "Added region [" << from << ", " << to << ")" << std::endl;
+void RegionChecker::add(ByteSpan span) {
+	if (span.data() < file.data() || span.data() + span.size() > file.data() + file.size()) { return; }
+	size_t from = span.data() - file.data();
+	add(from, from + span.size());
 }
 
-void RegionChecker::printRange(int from, int to) const {
-	for (int i = from; i < to; i++) {
-		if (fileUsage[i]) {
-			goto nonzero;
-		}
+void RegionChecker::printRange(size_t from, size_t to) const {
+	const uint8_t *begin = file.data() + from;
+	const uint8_t *end = file.data() + to;
+	if (std::all_of(begin, end, [](uint8_t byte){ return byte == 0; })) {
+		return;
 	}
-	return;
-nonzero:
 	std::cout << "Size: " << (to - from) << " Start: " << from << " End: " << to << std::endl;
 }
 
-void RegionChecker::printRegions() const {
-	bool inUnusedRegion = false;
-	int startMarker = 0;
-	for (int i = 0; i < usedBits.size(); i++) {
-		if (!inUnusedRegion && usedBits[i] == false) {
-			inUnusedRegion = true;
-			startMarker = i;
-		}
-		else if (inUnusedRegion && usedBits[i] == true) {
-			inUnusedRegion = false;
-			printRange(startMarker, i);
+void RegionChecker::printRegions(const fs::path &fileName) const {
+	size_t usedBytes = 0;
+	size_t startMarker = 0;
+	for (const auto& range : used) {
+		usedBytes += range.second - range.first;
+		if (startMarker < range.first) {
+			printRange(startMarker, range.first);
 		}
+		startMarker = range.second;
 	}
-	if (inUnusedRegion) {
-		printRange(startMarker, usedBits.size());
+	if (startMarker < file.size()) {
+		printRange(startMarker, file.size());
 	}
+	std::cout << fileName.string() << ": decoder used " << usedBytes << " of " << file.size() << " bytes" << std::endl;
 }
@@ -1,18 +1,31 @@
 #pragma once
 
 #include <stdint.h>
-#include <vector>
-#include <iostream>
+#include <map>
+#include "ByteSpan.hpp"
+#include "Config.hpp"
+#if ENABLE_MULTITHREADED
+#include <mutex>
+#endif
 
 /// Checks which regions were actually used by the decoder
 class RegionChecker {
 public:
-	RegionChecker(std::istream &file);
+	RegionChecker(ByteSpan file);
 
+	/// Marks `[from, to)` as used, safe to call from multiple threads
 	void add(size_t from, size_t to);
-	void printRegions() const;
+	/// Marks the bytes of `span` as used, ignoring it if it isn't part of this checker's file
+	void add(ByteSpan span);
+	/// Prints the unused ranges of the file that aren't all zeroes
+	void printRegions(const fs::path &fileName) const;
 private:
-	void printRange(int from, int to) const;
-	std::vector<bool> usedBits;
-	std::vector<bool> fileUsage;
+	void printRange(size_t from, size_t to) const;
+	ByteSpan file;
+	/// Start -> end of each used range, ranges never overlap or touch
+	std::map<size_t, size_t> used;
+#if ENABLE_MULTITHREADED
+	std::mutex mtx;
+#endif
 };
+
@@ -0,0 +1,494 @@
+#include "FileTypes.hpp"
+
+#include <stdint.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/endian/buffers.hpp>
+
+#include "Config.hpp"
+#include "MappedFile.hpp"
+#include "Utilities.hpp"
+
+#ifndef _WIN32
+#  include <csignal>
+#  include <sys/socket.h>
+#  include <sys/stat.h>
+#  include <sys/un.h>
+#  include <unistd.h>
+#endif
+
+#if ENABLE_MULTITHREADED
+#  include <thread>
+#endif
+
+namespace {
+
+/// One value of a job line, which is a flat JSON object
+struct JsonValue {
+	enum Type { String, Number, Bool, Null, Array } type = Null;
+	/// Decoded text of strings, source text of numbers
+	std::string text;
+	bool boolean = false;
+	/// Elements of an array, which may only hold strings
+	std::vector<std::string> strings;
+};
+
+/// Just enough JSON to read job lines, so the server doesn't need a JSON library
+class JsonParser {
+	const std::string &str;
+	size_t pos = 0;
+
+	[[noreturn]] void error(const char *what) {
+		throw std::runtime_error(std::string("Bad job line: ") + what + " at column " + std::to_string(pos + 1));
+	}
+
+	void skipSpace() {
+		while (pos < str.size() && (str[pos] == ' ' || str[pos] == '\t' || str[pos] == '\r' || str[pos] == '\n')) { pos++; }
+	}
+
+	bool consume(char c) {
+		skipSpace();
+		if (pos < str.size() && str[pos] == c) {
+			pos++;
+			return true;
+		}
+		return false;
+	}
+
+	void expect(char c) {
+		if (!consume(c)) { error("unexpected character"); }
+	}
+
+	void appendUTF8(std::string &out, uint32_t cp) {
+		if (cp < 0x80) {
+			out += (char)cp;
+		} else if (cp < 0x800) {
+			out += (char)(0xC0 | (cp >> 6));
+			out += (char)(0x80 | (cp & 0x3F));
+		} else if (cp < 0x10000) {
+			out += (char)(0xE0 | (cp >> 12));
+			out += (char)(0x80 | ((cp >> 6) & 0x3F));
+			out += (char)(0x80 | (cp & 0x3F));
+		} else {
+			out += (char)(0xF0 | (cp >> 18));
+			out += (char)(0x80 | ((cp >> 12) & 0x3F));
+			out += (char)(0x80 | ((cp >> 6) & 0x3F));
+			out += (char)(0x80 | (cp & 0x3F));
+		}
+	}
+
+	uint32_t hex4() {
+		if (str.size() - pos < 4) { error("truncated \\u escape"); }
+		uint32_t value = 0;
+		for (int i = 0; i < 4; i++) {
+			char c = str[pos++];
+			value <<= 4;
+			if (c >= '0' && c <= '9') { value |= c - '0'; }
+			else if (c >= 'a' && c <= 'f') { value |= c - 'a' + 10; }
+			else if (c >= 'A' && c <= 'F') { value |= c - 'A' + 10; }
+			else { error("bad \\u escape"); }
+		}
+		return value;
+	}
+
+	std::string string() {
+		expect('"');
+		std::string out;
+		while (true) {
+			if (pos >= str.size()) { error("unterminated string"); }
+			char c = str[pos++];
+			if (c == '"') { return out; }
+			if (c != '\\') {
+				out += c;
+				continue;
+			}
+			if (pos >= str.size()) { error("unterminated string"); }
+			switch (str[pos++]) {
+				case '"':  out += '"';  break;
+				case '\\': out += '\\'; break;
+				case '/':  out += '/';  break;
+				case 'b':  out += '\b'; break;
+				case 'f':  out += '\f'; break;
+				case 'n':  out += '\n'; break;
+				case 'r':  out += '\r'; break;
+				case 't':  out += '\t'; break;
+				case 'u': {
+					uint32_t cp = hex4();
+					if (cp >= 0xD800 && cp < 0xDC00 && str.compare(pos, 2, "\\u") == 0) {
+						pos += 2;
+						uint32_t low = hex4();
+						if (low < 0xDC00 || low >= 0xE000) { error("bad surrogate pair"); }
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+					}
+					appendUTF8(out, cp);
+					break;
+				}
+				default: error("bad escape");
+			}
+		}
+	}
+
+	JsonValue value() {
+		skipSpace();
+		JsonValue out;
+		if (pos >= str.size()) { error("missing value"); }
+		char c = str[pos];
+		if (c == '"') {
+			out.type = JsonValue::String;
+			out.text = string();
+		} else if (c == '[') {
+			pos++;
+			out.type = JsonValue::Array;
+			if (!consume(']')) {
+				do {
+					skipSpace();
+					out.strings.push_back(string());
+				} while (consume(','));
+				expect(']');
+			}
+		} else if (c == '-' || (c >= '0' && c <= '9')) {
+			out.type = JsonValue::Number;
+			size_t start = pos++;
+			while (pos < str.size() && strchr("0123456789.eE+-", str[pos])) { pos++; }
+			out.text = str.substr(start, pos - start);
+		} else if (str.compare(pos, 4, "true") == 0) {
+			out.type = JsonValue::Bool;
+			out.boolean = true;
+			pos += 4;
+		} else if (str.compare(pos, 5, "false") == 0) {
+			out.type = JsonValue::Bool;
+			pos += 5;
+		} else if (str.compare(pos, 4, "null") == 0) {
+			pos += 4;
+		} else {
+			error("unsupported value");
+		}
+		return out;
+	}
+
+public:
+	explicit JsonParser(const std::string &str): str(str) {}
+
+	std::map<std::string, JsonValue> object() {
+		std::map<std::string, JsonValue> out;
+		expect('{');
+		if (!consume('}')) {
+			do {
+				skipSpace();
+				std::string key = string();
+				expect(':');
+				out[key] = value();
+			} while (consume(','));
+			expect('}');
+		}
+		skipSpace();
+		if (pos != str.size()) { error("trailing characters"); }
+		return out;
+	}
+};
+
+std::string jsonString(const std::string &str) {
+	std::string out = "\"";
+	for (char c : str) {
+		switch (c) {
+			case '"':  out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			case '\n': out += "\\n";  break;
+			case '\r': out += "\\r";  break;
+			case '\t': out += "\\t";  break;
+			default:
+				if ((unsigned char)c < 0x20) {
+					char buf[8];
+					snprintf(buf, sizeof(buf), "\\u%04x", c);
+					out += buf;
+				} else {
+					out += c;
+				}
+		}
+	}
+	return out + "\"";
+}
+
+std::string idText(const JsonValue &id) {
+	switch (id.type) {
+		case JsonValue::String: return jsonString(id.text);
+		case JsonValue::Number: return id.text;
+		default: return "null";
+	}
+}
+
+/// Runs the job in `line`, returning its completion record
+/// `allowFd` is whether the job can name a descriptor of the server's to read from
+std::string runJob(const ConversionContext &options, const std::string &line, bool allowFd) {
+	auto start = std::chrono::steady_clock::now();
+	std::string id = "null";
+	auto failure = [&](const std::string &error) {
+		return "{\"id\":" + id + ",\"ok\":false,\"error\":" + jsonString(error) + "}";
+	};
+	try {
+		auto job = JsonParser(line).object();
+		auto found = job.find("id");
+		if (found != job.end()) { id = idText(found->second); }
+
+		ConversionContext ctx = options;
+		// Stats would go to stdout, which carries the completion records
+		ctx.printStats = false;
+		fs::path input, output;
+		int fd = -1;
+		for (const auto &field : job) {
+			const std::string &key = field.first;
+			const JsonValue &value = field.second;
+			bool isString = value.type == JsonValue::String;
+			if (key == "id") {
+				// Already read, so failures have it too
+			} else if (key == "input" && isString) {
+				input = fs::u8path(value.text);
+			} else if (key == "fd" && value.type == JsonValue::Number) {
+				fd = atoi(value.text.c_str());
+			} else if (key == "output" && isString) {
+				output = fs::u8path(value.text);
+			} else if (key == "thumbnail" && value.type == JsonValue::Number) {
+				ctx.thumbnailSize = std::max(atoi(value.text.c_str()), 0);
+			} else if (key == "only" && (isString || value.type == JsonValue::Array)) {
+				ctx.onlyNames.clear();
+				std::vector<std::string> names = value.strings;
+				if (isString) {
+					for (size_t begin = 0; begin <= value.text.size();) {
+						size_t end = std::min(value.text.find(',', begin), value.text.size());
+						names.push_back(value.text.substr(begin, end - begin));
+						begin = end + 1;
+					}
+				}
+				for (auto &name : names) {
+					if (!name.empty()) { ctx.onlyNames.push_back(std::move(name)); }
+				}
+			} else if (key == "bup_parts" && value.type == JsonValue::Bool) {
+				ctx.saveBupAsParts = value.boolean;
+			} else if (key == "stream" && value.type == JsonValue::Bool) {
+				ctx.streamPic = value.boolean;
+			} else {
+				return failure("Unknown or mistyped field \"" + key + "\"");
+			}
+		}
+		if (input.empty() == (fd < 0)) { return failure("Jobs need exactly one of \"input\" or \"fd\""); }
+		if (output.empty()) { return failure("Jobs need an \"output\""); }
+		// Stdout carries the completion records
+		if (isStdio(output)) { return failure("\"output\" can't be stdout"); }
+
+		std::unique_ptr<MappedFile> file;
+		if (fd >= 0) {
+#ifdef _WIN32
+			return failure("\"fd\" isn't supported on Windows");
+#else
+			// Socket clients can't pass descriptors, so any number they name would be one of the server's own
+			if (!allowFd) { return failure("\"fd\" can only be used with jobs from stdin"); }
+			if (fd <= 2) { return failure("\"fd\" can't be stdin, stdout or stderr"); }
+			// Reopening through /dev/fd lets MappedFile map regular files and read pipes the usual way
+			// The descriptor stays open, it belongs to whoever started the server
+			ctx.fileName = "fd " + std::to_string(fd);
+			file = std::make_unique<MappedFile>("/dev/fd/" + std::to_string(fd));
+#endif
+		} else {
+			ctx.fileName = input;
+			file = std::make_unique<MappedFile>(input);
+		}
+		ByteSpan in = file->data();
+		if (in.size() < 4) { return failure("File is too small to have a magic number"); }
+		boost::endian::big_int32_buf_t magic;
+		memcpy(&magic, in.data(), 4);
+		ProcessFunction process = processFunctionFor(magic.value());
+		if (!process) { return failure("Unknown file type"); }
+
+		if (output.has_parent_path()) {
+			fs::create_directories(output.parent_path());
+		}
+		OutputRecorder recorder;
+		ctx.recorder = &recorder;
+		int result;
+		try {
+			result = process(ctx, in, output);
+		} catch (...) {
+#if ENABLE_MULTITHREADED
+			ThreadedImageSaver::shared().waitFor(recorder);
+#endif
+			throw;
+		}
+#if ENABLE_MULTITHREADED
+		ThreadedImageSaver::shared().waitFor(recorder);
+#endif
+		if (result != 0) { return failure("Conversion failed"); }
+		if (recorder.failed()) { return failure("Failed to save an output"); }
+
+		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+		std::string record = "{\"id\":" + id + ",\"ok\":true,\"outputs\":[";
+		bool first = true;
+		for (const auto &path : recorder.take()) {
+			if (!first) { record += ","; }
+			first = false;
+#if USE_BOOST_FS
+			record += jsonString(path.string());
+#else
+			record += jsonString(path.u8string());
+#endif
+		}
+		return record + "],\"ms\":" + std::to_string(ms) + "}";
+	} catch (std::exception &e) {
+		return failure(e.what());
+	}
+}
+
+/// Where job lines come from and completion records go
+class JobStream {
+public:
+	virtual ~JobStream() {}
+	/// Returns false once there are no more lines
+	virtual bool readLine(std::string &line) = 0;
+	/// Only called by one thread at a time
+	virtual void writeLine(const std::string &line) = 0;
+	/// Whether jobs can read from the server's descriptors with "fd"
+	virtual bool allowsFd() const { return false; }
+};
+
+class StdioJobStream: public JobStream {
+public:
+	bool readLine(std::string &line) override {
+		return (bool)std::getline(std::cin, line);
+	}
+	void writeLine(const std::string &line) override {
+		std::cout << line << std::endl;
+	}
+	/// Whoever started the server can give it descriptors to read
+	bool allowsFd() const override { return true; }
+};
+
+#ifndef _WIN32
+class SocketJobStream: public JobStream {
+	int fd;
+	std::string buffer;
+	bool closed = false;
+public:
+	explicit SocketJobStream(int fd): fd(fd) {}
+	~SocketJobStream() { close(fd); }
+
+	bool readLine(std::string &line) override {
+		while (true) {
+			size_t newline = buffer.find('\n');
+			if (newline != std::string::npos) {
+				line = buffer.substr(0, newline);
+				buffer.erase(0, newline + 1);
+				return true;
+			}
+			if (closed) {
+				if (buffer.empty()) { return false; }
+				line = std::move(buffer);
+				buffer.clear();
+				return true;
+			}
+			char chunk[4096];
+			ssize_t amt = read(fd, chunk, sizeof(chunk));
+			if (amt < 0 && errno == EINTR) { continue; }
+			if (amt <= 0) {
+				closed = true;
+			} else {
+				buffer.append(chunk, amt);
+			}
+		}
+	}
+
+	void writeLine(const std::string &line) override {
+		std::string data = line + "\n";
+		for (size_t done = 0; done < data.size();) {
+			ssize_t amt = write(fd, data.data() + done, data.size() - done);
+			if (amt < 0 && errno == EINTR) { continue; }
+			// The client went away, nothing else to do with the record
+			if (amt <= 0) { return; }
+			done += amt;
+		}
+	}
+};
+#endif
+
+/// Runs every job from `stream`, writing each record as soon as its job completes
+void serveStream(const ConversionContext &options, JobStream &stream) {
+	std::string line;
+#if ENABLE_MULTITHREADED
+	std::mutex writeMtx;
+	TaskGroup jobs(DECODE_THREADS > 0 ? DECODE_THREADS : SIZE_MAX);
+	while (stream.readLine(line)) {
+		if (line.find_first_not_of(" \t\r") == std::string::npos) { continue; }
+		jobs.run([&options, &stream, &writeMtx, line]{
+			std::string record = runJob(options, line, stream.allowsFd());
+			std::lock_guard<std::mutex> l(writeMtx);
+			stream.writeLine(record);
+		});
+	}
+	jobs.wait();
+#else
+	while (stream.readLine(line)) {
+		if (line.find_first_not_of(" \t\r") == std::string::npos) { continue; }
+		stream.writeLine(runJob(options, line, stream.allowsFd()));
+	}
+#endif
+}
+
+}
+
+int serve(const ConversionContext &options, const fs::path &socketPath) {
+	if (socketPath.empty()) {
+		StdioJobStream stream;
+		serveStream(options, stream);
+		return 0;
+	}
+#ifdef _WIN32
+	std::cerr << "-socket isn't supported on Windows" << std::endl;
+	return EXIT_FAILURE;
+#else
+	// Clients that disconnect early shouldn't kill the server
+	signal(SIGPIPE, SIG_IGN);
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socketPath.native().size() >= sizeof(addr.sun_path)) {
+		std::cerr << socketPath.string() << ": socket path is too long" << std::endl;
+		return EXIT_FAILURE;
+	}
+	strcpy(addr.sun_path, socketPath.c_str());
+	// Replace the socket left behind by an earlier server, but nothing else
+	struct stat st;
+	if (lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(socketPath.c_str());
+	}
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+		std::cerr << socketPath.string() << ": failed to listen: " << strerror(errno) << std::endl;
+		return EXIT_FAILURE;
+	}
+	while (true) {
+		int client = accept(listener, nullptr, nullptr);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) { continue; }
+			std::cerr << socketPath.string() << ": failed to accept: " << strerror(errno) << std::endl;
+			close(listener);
+			return EXIT_FAILURE;
+		}
+#if ENABLE_MULTITHREADED
+		// Connections only read lines and wait, the jobs themselves run on the pool
+		std::thread([&options, client]{
+			SocketJobStream stream(client);
+			serveStream(options, stream);
+		}).detach();
+#else
+		SocketJobStream stream(client);
+		serveStream(options, stream);
+#endif
+	}
+#endif
+}
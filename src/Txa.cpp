@@ -1,44 +1,66 @@
 #include "FileTypes.hpp"
 
 #include <stdint.h>
+#include <exception>
 #include "Config.hpp"
 #include "FS.hpp"
 #include "HeaderStructs.hpp"
 #include "Decompression.hpp"
 #include "Utilities.hpp"
 
-int processTxa(std::istream &in, const fs::path &output) {
+int processTxa(const ConversionContext &ctx, ByteSpan in, const fs::path &output) {
 	fs::path outputDir = output.parent_path();
 	std::string outTemplate = output.stem().string();
 
+	SpanReader reader(ctx, in);
 	TxaHeader header;
-	in >> header;
+	reader >> header;
+
+	std::vector<size_t> selected;
+	for (size_t i = 0; i < header.chunks.size(); i++) {
+		if (ctx.isNameSelected(header.chunks[i].name)) { selected.push_back(i); }
+	}
+	if (selected.empty() && !ctx.onlyNames.empty()) {
+		std::cerr << ctx.fileName.string() << ": no chunks matched the names given to -only" << std::endl;
+	}
 
 #if ENABLE_MULTITHREADED
-	ThreadedImageSaver saver;
+	std::mutex mtx;
 #endif
+	std::exception_ptr error;
 
-	for (const auto& chunk : header.chunks) {
+	// Workers all decode straight out of the shared input and feed the encode stage directly
+	parallel_for(0, selected.size(), []{ return 0; }, [&](int, size_t k) {
+		const auto& chunk = header.chunks[selected[k]];
 		std::string outName = outTemplate + "_" + chunk.name;
 		Image currentChunk({0, 0});
-		processChunkNoHeader(currentChunk, chunk.offset, chunk.length, header.indexed, chunk.width, chunk.height, in, outName, header.isSwitch);
-
-		auto outFilename = outputDir/fs::u8path(outName + ".png");
+		try {
+			processChunkNoHeader(ctx, currentChunk, chunk.offset, chunk.length, header.indexed, chunk.width, chunk.height, in, outName, header.isSwitch);
+		} catch (...) {
 #if ENABLE_MULTITHREADED
-		saver.enqueue(std::move(currentChunk), std::move(outFilename));
-#else
-		currentChunk.writePNG(outFilename);
+			std::lock_guard<std::mutex> l(mtx);
 #endif
+			if (!error) { error = std::current_exception(); }
+			return;
+		}
+
+		auto outFilename = outputDir/fs::u8path(outName + ".png");
+		saveImage(ctx, std::move(currentChunk), std::move(outFilename));
+	});
+
+	if (error) {
+		std::rethrow_exception(error);
 	}
 	return 0;
 }
 
-int replaceTxa(std::istream &in, std::ostream &output, const fs::path &replacement) {
+int replaceTxa(const ConversionContext &ctx, ByteSpan in, std::ostream &output, const fs::path &replacement) {
 	fs::path replacementDir = replacement.parent_path();
 	std::string replacementTemplate = replacement.stem().string();
 
+	SpanReader reader(ctx, in);
 	TxaHeader header;
-	in >> header;
+	reader >> header;
 
 	std::vector<Image> images(header.chunks.size(), Image());
 	std::vector<std::vector<uint8_t>> chunks(header.chunks.size(), std::vector<uint8_t>());
@@ -55,7 +77,7 @@ int replaceTxa(std::istream &in, std::ostream &output, const fs::path &replaceme
 		} catch (std::runtime_error&) {
 			fprintf(stderr, "Failed to load replacement %s, not replacing\n", rfilename.string().c_str());
 			const auto& chunk = header.chunks[i];
-			processChunkNoHeader(images[i], chunk.offset, chunk.length, header.indexed, chunk.width, chunk.height, in, replacementName, header.isSwitch);
+			processChunkNoHeader(ctx, images[i], chunk.offset, chunk.length, header.indexed, chunk.width, chunk.height, in, replacementName, header.isSwitch);
 		}
 
 		if (!compressor.canPalette(images[i], false)) {
@@ -88,7 +110,7 @@ int replaceTxa(std::istream &in, std::ostream &output, const fs::path &replaceme
 	header.filesize = pos;
 	header.write(output, in);
 	for (size_t i = 0; i < chunks.size(); i++) {
-		output.seekp(header.chunks[i].offset, output.beg);
+		seekpZeroFilled(output, header.chunks[i].offset);
 		output.write(reinterpret_cast<const char*>(chunks[i].data()), chunks[i].size());
 	}
 	return 0;
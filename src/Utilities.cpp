@@ -1,42 +1,447 @@
 #include "Utilities.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+int THREAD_COUNT = 0;
+size_t SAVE_QUEUE_BYTES = 256 << 20;
+int READ_THREADS = 0;
+int DECODE_THREADS = 0;
+int ENCODE_THREADS = 0;
+
+bool globMatch(const std::string &pattern, const std::string &str) {
+	size_t p = 0, s = 0;
+	// Position to retry from after the last `*`
+	size_t starP = std::string::npos, starS = 0;
+	while (s < str.size()) {
+		if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == str[s])) {
+			p++;
+			s++;
+		} else if (p < pattern.size() && pattern[p] == '*') {
+			starP = p++;
+			starS = s;
+		} else if (starP != std::string::npos) {
+			p = starP + 1;
+			s = ++starS;
+		} else {
+			return false;
+		}
+	}
+	while (p < pattern.size() && pattern[p] == '*') { p++; }
+	return p == pattern.size();
+}
+
+bool ConversionContext::isNameSelected(const std::string &name) const {
+	if (onlyNames.empty()) { return true; }
+	for (const auto& pattern : onlyNames) {
+		if (globMatch(pattern, name)) { return true; }
+	}
+	return false;
+}
+
+void ConversionContext::recordOutput(const fs::path &path) const {
+	if (recorder) {
+		recorder->add(path);
+	}
+}
+
+void OutputRecorder::add(const fs::path &path) {
+#if ENABLE_MULTITHREADED
+	std::lock_guard<std::mutex> l(mtx);
+#endif
+	paths.push_back(path);
+}
+
+std::vector<fs::path> OutputRecorder::take() {
+#if ENABLE_MULTITHREADED
+	std::lock_guard<std::mutex> l(mtx);
+#endif
+	return std::move(paths);
+}
+
+void OutputRecorder::fail() {
+#if ENABLE_MULTITHREADED
+	std::lock_guard<std::mutex> l(mtx);
+#endif
+	saveFailed = true;
+}
+
+bool OutputRecorder::failed() {
+#if ENABLE_MULTITHREADED
+	std::lock_guard<std::mutex> l(mtx);
+#endif
+	return saveFailed;
+}
+
+#if ENABLE_MULTITHREADED
+void OutputRecorder::saveQueued() {
+	std::lock_guard<std::mutex> l(mtx);
+	pendingSaves++;
+}
+
+void OutputRecorder::saveFinished(bool ok) {
+	std::lock_guard<std::mutex> l(mtx);
+	if (!ok) { saveFailed = true; }
+	pendingSaves--;
+	// Notify under the lock, since the waiter may destroy the recorder as soon as it sees no pending saves
+	cv.notify_all();
+}
+
+void OutputRecorder::waitForSaves() {
+	std::unique_lock<std::mutex> l(mtx);
+	cv.wait(l, [&]{ return pendingSaves == 0; });
+}
+
+bool OutputRecorder::savesPending() {
+	std::lock_guard<std::mutex> l(mtx);
+	return pendingSaves > 0;
+}
+#endif
+
+int saveImage(const ConversionContext &ctx, Image img, fs::path path) {
+	if (ctx.sink) {
+		ctx.sink->add(path, PNGColorType::RGBA, img.size, reinterpret_cast<const uint8_t *>(img.colorData.data()));
+		return 0;
+	}
+	if (ctx.outputStream) {
+		return writePNG(*ctx.outputStream, PNGColorType::RGBA, img.size, reinterpret_cast<const uint8_t *>(img.colorData.data()));
+	}
+#if ENABLE_MULTITHREADED
+	ThreadedImageSaver::shared().enqueue(std::move(img), std::move(path), ctx.recorder);
+	return 0;
+#else
+	ctx.recordOutput(path);
+	int res = img.writePNG(path);
+	if (res != 0 && ctx.recorder) {
+		ctx.recorder->fail();
+	}
+	return res;
+#endif
+}
+
+int saveImage(const ConversionContext &ctx, const fs::path &path, PNGColorType color, Size size, const uint8_t *data) {
+	if (ctx.sink) {
+		ctx.sink->add(path, color, size, data);
+		return 0;
+	}
+	if (ctx.outputStream) {
+		return writePNG(*ctx.outputStream, color, size, data);
+	}
+	ctx.recordOutput(path);
+	int res = writePNG(path, color, size, data);
+	if (res != 0 && ctx.recorder) {
+		ctx.recorder->fail();
+	}
+	return res;
+}
+
+#if defined(__linux__) && ENABLE_MULTITHREADED
+/// CPUs worth of time the cgroup quota allows, or 0 if there's no quota
+static double cgroupCpuQuota() {
+	// cgroup v2: "max 100000" or "<quota> <period>"
+	if (FILE *file = fopen("/sys/fs/cgroup/cpu.max", "r")) {
+		char quota[32];
+		long long period;
+		int read = fscanf(file, "%31s %lld", quota, &period);
+		fclose(file);
+		if (read == 2 && strcmp(quota, "max") != 0 && period > 0) {
+			return atoll(quota) / (double)period;
+		}
+		return 0;
+	}
+	// cgroup v1, quota is -1 without a limit
+	long long quota = -1, period = 0;
+	if (FILE *file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) {
+		if (fscanf(file, "%lld", &quota) != 1) { quota = -1; }
+		fclose(file);
+	}
+	if (FILE *file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) {
+		if (fscanf(file, "%lld", &period) != 1) { period = 0; }
+		fclose(file);
+	}
+	return quota > 0 && period > 0 ? quota / (double)period : 0;
+}
+#endif
+
+static size_t detectThreadCount() {
+#if ENABLE_MULTITHREADED
+	size_t count = std::thread::hardware_concurrency();
+#if defined(__linux__)
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		count = CPU_COUNT(&set);
+	}
+	double quota = cgroupCpuQuota();
+	if (quota > 0) {
+		count = std::min(count, static_cast<size_t>(std::ceil(quota)));
+	}
+#endif
+	return std::max<size_t>(count, 1);
+#else
+	return 1;
+#endif
+}
+
+size_t threadCount() {
+	static const size_t count = THREAD_COUNT > 0 ? THREAD_COUNT : detectThreadCount();
+	return count;
+}
+
 #if ENABLE_MULTITHREADED
 
-ThreadedImageSaver::ThreadedImageSaver() {
-	for (size_t i = 0; i < std::thread::hardware_concurrency(); i++) {
-		threads.emplace_back(&ThreadedImageSaver::runThread, this);
+thread_local int ThreadPool::currentWorker = -1;
+
+ThreadPool::ThreadPool(size_t numThreads) {
+	for (size_t i = 0; i < numThreads; i++) {
+		workers.push_back(std::make_unique<Worker>());
+	}
+	for (size_t i = 0; i < numThreads; i++) {
+		threads.emplace_back(&ThreadPool::runThread, this, i);
 	}
 }
 
-ThreadedImageSaver::~ThreadedImageSaver() {
-	stopped = true;
-	(void)std::lock_guard<std::mutex>(mtx);
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		stopped = true;
+	}
 	cv.notify_all();
 	for (auto& thread : threads) {
 		thread.join();
 	}
 }
 
-void ThreadedImageSaver::runThread() {
-	std::unique_lock<std::mutex> l(mtx);
-	while (!stopped) {
-		cv.wait(l);
-		while (!images.empty()) {
-			auto img = std::move(images.back());
-			images.pop_back();
-			l.unlock();
-			img.first.writePNG(img.second);
-			l.lock();
+ThreadPool &ThreadPool::shared() {
+	// Whoever submits work also works on it (or waits), so one less thread keeps us at threadCount busy threads
+	static ThreadPool pool(std::max<size_t>(threadCount(), 2) - 1);
+	return pool;
+}
+
+bool ThreadPool::takeTask(size_t self, std::function<void()> &task) {
+	// Newest from our own deque, since it's most likely to still be in cache
+	{
+		Worker &own = *workers[self];
+		std::lock_guard<std::mutex> l(own.mtx);
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			queued--;
+			return true;
+		}
+	}
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		if (!injected.empty()) {
+			task = std::move(injected.front());
+			injected.pop_front();
+			queued--;
+			return true;
+		}
+	}
+	// Oldest from everyone else, which tends to be the biggest piece of work they have
+	for (size_t i = 1; i < workers.size(); i++) {
+		Worker &victim = *workers[(self + i) % workers.size()];
+		std::lock_guard<std::mutex> l(victim.mtx);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			queued--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::runThread(size_t self) {
+	currentWorker = static_cast<int>(self);
+	std::function<void()> task;
+	while (true) {
+		if (takeTask(self, task)) {
+			task();
+			task = nullptr;
+			continue;
 		}
+		std::unique_lock<std::mutex> l(mtx);
+		cv.wait(l, [&]{ return stopped || queued > 0; });
+		if (stopped && queued == 0) { return; }
 	}
 }
 
-void ThreadedImageSaver::enqueue(Image img, fs::path path) {
+void ThreadPool::submit(std::function<void()> task) {
+	if (currentWorker >= 0) {
+		Worker &own = *workers[currentWorker];
+		std::lock_guard<std::mutex> l(own.mtx);
+		own.tasks.push_back(std::move(task));
+		queued++;
+	} else {
+		std::lock_guard<std::mutex> l(mtx);
+		injected.push_back(std::move(task));
+		queued++;
+	}
+	// Taking the lock makes sure a thread that just saw nothing queued is already waiting
 	{
 		std::lock_guard<std::mutex> l(mtx);
-		images.emplace_back(std::move(img), std::move(path));
 	}
 	cv.notify_one();
 }
 
+struct TaskGroup::State {
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<std::function<void()>> pending;
+	size_t running = 0;
+	/// Pool tasks working through `pending`, at most `maxWorkers`
+	size_t workers = 0;
+	size_t maxWorkers;
+	std::exception_ptr error;
+
+	State(size_t maxWorkers): maxWorkers(std::max<size_t>(maxWorkers, 1)) {}
+
+	/// Runs the next pending task, returns false if there wasn't one
+	/// `l` must hold `mtx`, and is unlocked while the task runs
+	bool runOne(std::unique_lock<std::mutex> &l) {
+		if (pending.empty()) { return false; }
+		auto task = std::move(pending.front());
+		pending.pop_front();
+		running++;
+		l.unlock();
+		std::exception_ptr taskError;
+		try {
+			task();
+		} catch (...) {
+			taskError = std::current_exception();
+		}
+		l.lock();
+		if (taskError && !error) { error = taskError; }
+		running--;
+		if (running == 0 && pending.empty()) { cv.notify_all(); }
+		return true;
+	}
+};
+
+TaskGroup::TaskGroup(size_t maxWorkers): state(std::make_shared<State>(maxWorkers)) {}
+
+TaskGroup::~TaskGroup() {
+	try {
+		wait();
+	} catch (...) {}
+}
+
+void TaskGroup::run(std::function<void()> task) {
+	bool newWorker;
+	{
+		std::lock_guard<std::mutex> l(state->mtx);
+		state->pending.push_back(std::move(task));
+		newWorker = state->workers < state->maxWorkers;
+		if (newWorker) { state->workers++; }
+	}
+	if (!newWorker) { return; }
+	// Keeps going until the group runs out, so an existing worker picks up tasks added while it's busy
+	// It may also find them all already taken by `wait`, in which case it does nothing
+	ThreadPool::shared().submit([state = state]{
+		std::unique_lock<std::mutex> l(state->mtx);
+		while (state->runOne(l)) {}
+		state->workers--;
+	});
+}
+
+void TaskGroup::wait() {
+	std::unique_lock<std::mutex> l(state->mtx);
+	while (state->runOne(l)) {}
+	state->cv.wait(l, [&]{ return state->running == 0 && state->pending.empty(); });
+	if (state->error) {
+		std::exception_ptr error = std::move(state->error);
+		state->error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+bool TaskGroup::runPending() {
+	std::unique_lock<std::mutex> l(state->mtx);
+	return state->runOne(l);
+}
+
+ThreadedImageSaver::ThreadedImageSaver(): tasks(ENCODE_THREADS > 0 ? ENCODE_THREADS : SIZE_MAX) {}
+
+ThreadedImageSaver &ThreadedImageSaver::shared() {
+	static ThreadedImageSaver saver;
+	return saver;
+}
+
+size_t ThreadedImageSaver::wait(bool printStats) {
+	tasks.wait();
+	std::lock_guard<std::mutex> l(mtx);
+	if (printStats && saved > 0) {
+		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(blocked).count();
+		std::cout << "Saved " << saved << " images, blocked on the save queue for " << ms << "ms" << std::endl;
+	}
+	size_t result = failed;
+	saved = 0;
+	failed = 0;
+	blocked = std::chrono::steady_clock::duration(0);
+	return result;
+}
+
+void ThreadedImageSaver::enqueue(Image img, fs::path path, OutputRecorder *recorder) {
+	if (recorder) {
+		recorder->add(path);
+		recorder->saveQueued();
+	}
+	size_t bytes = img.colorData.size() * sizeof(Color);
+	{
+		std::unique_lock<std::mutex> l(mtx);
+		saved++;
+		// Always let one image through, however big it is
+		if (queuedBytes > 0 && queuedBytes + bytes > SAVE_QUEUE_BYTES) {
+			auto start = std::chrono::steady_clock::now();
+			while (queuedBytes > 0 && queuedBytes + bytes > SAVE_QUEUE_BYTES) {
+				l.unlock();
+				// Help out with the oldest image rather than sit idle, if no one's started on it
+				bool ran = tasks.runPending();
+				l.lock();
+				if (!ran) {
+					cv.wait(l, [&]{ return queuedBytes == 0 || queuedBytes + bytes <= SAVE_QUEUE_BYTES; });
+				}
+			}
+			blocked += std::chrono::steady_clock::now() - start;
+		}
+		queuedBytes += bytes;
+	}
+	tasks.run([this, bytes, recorder, img = std::move(img), path = std::move(path)]{
+		bool ok;
+		try {
+			ok = img.writePNG(path) == 0;
+		} catch (std::exception &e) {
+			std::cerr << "Failed to save image " << path.string() << ": " << e.what() << std::endl;
+			ok = false;
+		}
+		{
+			std::lock_guard<std::mutex> l(mtx);
+			queuedBytes -= bytes;
+			if (!ok) { failed++; }
+		}
+		cv.notify_all();
+		// Last, since this may let the recorder's owner move on and destroy it
+		if (recorder) {
+			recorder->saveFinished(ok);
+		}
+	});
+}
+
+void ThreadedImageSaver::waitFor(OutputRecorder &recorder) {
+	while (recorder.savesPending()) {
+		// The remaining images may be stuck behind ones from other conversions, so help write those
+		if (!tasks.runPending()) {
+			recorder.waitForSaves();
+		}
+	}
+}
+
 #endif
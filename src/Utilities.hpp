@@ -1,12 +1,19 @@
 #pragma once
 
 #include "Config.hpp"
+#include "Image.hpp"
+#include <string>
+#include <vector>
 #if ENABLE_MULTITHREADED
 #include <thread>
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
-#include <vector>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <chrono>
 #endif
 
 #ifdef __clang__
@@ -19,42 +26,173 @@ static size_t align(size_t value, size_t alignment) {
 	return (value + alignment - 1) / alignment * alignment;
 }
 
+/// Number of threads to work with, from -j or else the CPUs this process is allowed to use
+size_t threadCount();
+
+#if ENABLE_MULTITHREADED
+/// Process-wide work-stealing pool that every parallel_for, TaskGroup and ThreadedImageSaver runs on, created on first use
+/// Each pool thread has its own deque of tasks, taking the newest from its own and stealing the oldest from the others when it runs out
+/// Tasks submitted from pool threads go on that thread's deque, others go on a shared queue
+class ThreadPool {
+	struct Worker {
+		std::mutex mtx;
+		std::deque<std::function<void()>> tasks;
+	};
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+	/// Tasks submitted from outside the pool
+	std::deque<std::function<void()>> injected;
+	std::mutex mtx;
+	std::condition_variable cv;
+	/// Tasks in all queues, so idle threads know when to sleep
+	std::atomic<size_t> queued{0};
+	bool stopped = false;
+	/// Index of the pool thread this is, or -1 for threads outside the pool
+	static thread_local int currentWorker;
+	bool takeTask(size_t self, std::function<void()> &task);
+	void runThread(size_t self);
+	ThreadPool(size_t numThreads);
+public:
+	~ThreadPool();
+	static ThreadPool &shared();
+	void submit(std::function<void()> task);
+};
+
+/// A set of tasks run on the shared pool that can be waited on
+/// `wait` runs tasks that no pool thread has started yet on the calling thread, so waiting from inside the pool can't deadlock
+/// At most `maxWorkers` pool threads run the group's tasks at once (plus any thread waiting on it), which is how pipeline stages are sized
+/// Tasks start in the order they were added, since each pool task the group submits runs whichever of its tasks is oldest rather than a particular one
+class TaskGroup {
+	struct State;
+	std::shared_ptr<State> state;
+public:
+	explicit TaskGroup(size_t maxWorkers = SIZE_MAX);
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+	/// Waits for the tasks, ignoring their errors
+	~TaskGroup();
+	void run(std::function<void()> task);
+	/// Waits for every task to finish, then rethrows the first exception any of them threw
+	void wait();
+	/// Runs one task that no thread has started yet on the calling thread, returns false if there wasn't one
+	bool runPending();
+};
+#endif
+
+/// Runs `fn(state, i)` for every `i` in `[begin, end)`, with one `state = makeState()` per thread
+/// The calling thread works too, and the first exception thrown by `fn` is rethrown once every thread stops
 template <typename MakeState, typename Execute>
 void parallel_for(size_t begin, size_t end, MakeState makeState, Execute&& fn) {
 #if ENABLE_MULTITHREADED
-	std::atomic<size_t> i{begin};
-	std::vector<std::thread> threads;
-	for (int j = 0; j < std::thread::hardware_concurrency(); j++) {
-		threads.emplace_back([&]() ARTIFICIAL {
+	size_t workers = std::min(threadCount(), end > begin ? end - begin : 0);
+	if (workers > 1) {
+		std::atomic<size_t> i{begin};
+		auto work = [&]() ARTIFICIAL {
+			size_t value = i.fetch_add(1, std::memory_order_relaxed);
+			if (value >= end) { return; }
 			auto state = makeState();
-			while (true) {
-				size_t value = i.fetch_add(1, std::memory_order_relaxed);
-				if (value >= end) { return; }
-				fn(state, value);
+			for (; value < end; value = i.fetch_add(1, std::memory_order_relaxed)) {
+				try {
+					fn(state, value);
+				} catch (...) {
+					// Stop handing out more work
+					i = end;
+					throw;
+				}
 			}
-		});
+		};
+		TaskGroup group;
+		for (size_t j = 1; j < workers; j++) {
+			group.run(work);
+		}
+		std::exception_ptr error;
+		try {
+			work();
+		} catch (...) {
+			error = std::current_exception();
+		}
+		try {
+			group.wait();
+		} catch (...) {
+			if (!error) { error = std::current_exception(); }
+		}
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		return;
 	}
-	for (auto& thread : threads) { thread.join(); }
-#else
+#endif
 	auto state = makeState();
 	for (size_t i = begin; i < end; i++) {
 		fn(state, i);
 	}
-#endif
 }
 
+/// Matches `str` against a pattern where `*` matches any run of characters and `?` matches one character
+bool globMatch(const std::string &pattern, const std::string &str);
+
+/// Collects the paths of every file written while converting one input, for batch manifests
+/// Set as a conversion's `ConversionContext::recorder`
+/// Also notes whether any of them failed to save, since saving can finish after the conversion returns
+class OutputRecorder {
+	std::vector<fs::path> paths;
+	bool saveFailed = false;
 #if ENABLE_MULTITHREADED
-#include "Image.hpp"
-class ThreadedImageSaver {
-	std::vector<std::thread> threads;
-	std::vector<std::pair<Image, fs::path>> images;
-	std::condition_variable cv;
 	std::mutex mtx;
-	bool stopped = false;
-	void runThread();
+	std::condition_variable cv;
+	/// Images queued on the encode stage that haven't been written yet
+	size_t pendingSaves = 0;
+#endif
+public:
+	void add(const fs::path &path);
+	std::vector<fs::path> take();
+	void fail();
+	bool failed();
+#if ENABLE_MULTITHREADED
+	void saveQueued();
+	void saveFinished(bool ok);
+	/// Waits until every image queued for this conversion has been written
+	/// Pool threads should use `ThreadedImageSaver::waitFor` instead, which helps with the saving
+	void waitForSaves();
+	bool savesPending();
+#endif
+};
+
+/// Receives a conversion's output images instead of them being written to files
+class ImageSink {
 public:
-	void enqueue(Image img, fs::path path);
+	virtual ~ImageSink() {}
+	/// `path` is where the image would have been written, may be called from multiple threads at once
+	virtual void add(const fs::path &path, PNGColorType color, Size size, const uint8_t *data) = 0;
+};
+
+/// Writes `img` to `path` (or `ctx.sink` or `ctx.outputStream`, if set) as a PNG, as an output of the conversion `ctx`
+/// With multithreading enabled, writing to a path queues it on the encode stage and returns 0, and a failure is reported to `ctx.recorder` and by `ThreadedImageSaver::wait`
+int saveImage(const ConversionContext &ctx, Image img, fs::path path);
+/// Writes the pixels to `path` as a PNG right away, as an output of the conversion `ctx`
+int saveImage(const ConversionContext &ctx, const fs::path &path, PNGColorType color, Size size, const uint8_t *data);
+
+#if ENABLE_MULTITHREADED
+/// The encode stage, which compresses and writes images on the shared pool in the order they were queued, using at most ENCODE_THREADS pool threads
+/// Once the queued images take up more than SAVE_QUEUE_BYTES, `enqueue` writes images itself until there's room
+class ThreadedImageSaver {
+	std::mutex mtx;
+	std::condition_variable cv;
+	size_t queuedBytes = 0;
+	size_t saved = 0;
+	size_t failed = 0;
+	/// Time `enqueue` spent writing or waiting for room in the queue
+	std::chrono::steady_clock::duration blocked{0};
+	/// Last so that it's destroyed (and waits for its tasks) first
+	TaskGroup tasks;
 	ThreadedImageSaver();
-	~ThreadedImageSaver();
+public:
+	static ThreadedImageSaver &shared();
+	/// `recorder` (if any) is told about the output, and whether it failed to save
+	void enqueue(Image img, fs::path path, OutputRecorder *recorder);
+	/// Waits for every queued image to be written, returning how many couldn't be since the last `wait`
+	size_t wait(bool printStats = false);
+	/// Waits for the images queued for `recorder`'s conversion to be written, saving queued images on the calling thread meanwhile
+	void waitFor(OutputRecorder &recorder);
 };
 #endif
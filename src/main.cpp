@@ -2,35 +2,95 @@
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <sstream>
 
 #include <boost/endian/buffers.hpp>
 
 #include "Config.hpp"
+#include "Decompression.hpp"
 #include "FileTypes.hpp"
+#include "HeaderStructs.hpp"
+#include "MappedFile.hpp"
+#include "RegionChecker.hpp"
+#include "Utilities.hpp"
 
 int usage(int argc, const char **argv) {
 	std::cerr << "Usage: " << argv[0] << " file.(pic|bup|txa|msk) file.png OPTIONS" << std::endl;
 	std::cerr << "    Converts Switch and PS3 Higurashi picture file file.pic to PNG file.png" << std::endl;
+	std::cerr << "    Either file can be - to read the input from stdin or write a pic or msk file's PNG to stdout" << std::endl;
+	std::cerr << "       " << argv[0] << " -r input_folder output_folder OPTIONS" << std::endl;
+	std::cerr << "    Converts every supported file in input_folder and its subfolders, mirroring the folder structure in output_folder" << std::endl;
+	std::cerr << "       " << argv[0] << " -serve [-socket path] OPTIONS" << std::endl;
+	std::cerr << "    Runs conversion jobs given as lines of JSON on stdin (or connections to the given Unix socket), see Readme.md" << std::endl;
 	std::cerr << "Options:" << std::endl;
 	std::cerr << "    -replace replacement.png: Convert the given png to a file of the same type as the input and write it to the output" << std::endl;
 	std::cerr << "    -debug-images debugImagesFolder: Write individual chunks to the given folder for debugging" << std::endl;
 	std::cerr << "    -bup-parts: Output separately combinable parts instead of precombined images when decoding bup files" << std::endl;
+	std::cerr << "    -mask mask.msk: Use the given msk file as the alpha channel of a pic file" << std::endl;
+	std::cerr << "    -crop x,y,w,h: Only decode the given region of a pic file" << std::endl;
+	std::cerr << "    -only name[,name...]: Only extract the txa chunks / bup expressions with the given names, which may use * and ? wildcards" << std::endl;
+	std::cerr << "    -thumbnail N: Scale pic and composited bup output down to fit in an NxN square, without decoding to a full size image first" << std::endl;
+	std::cerr << "    -stream: Decode pic files one row of chunks at a time, writing out finished rows immediately to reduce memory usage" << std::endl;
+	std::cerr << "    -stats: Print decoding statistics" << std::endl;
+	std::cerr << "    -j N: Use N threads, defaults to the number of CPUs available to the process" << std::endl;
+	std::cerr << "    -save-queue MB: Memory for decoded images waiting to be saved, decoding pauses once it fills up (default 256)" << std::endl;
+	std::cerr << "    -stage-threads read,decode,encode: Limit the threads reading input files, decoding them and saving PNGs, 0 for the default (2 readers, no limit otherwise)" << std::endl;
+	std::cerr << "    -shard i/n: With -r, only convert the files in shard i (counting from 0) of n, so n processes or machines can split up one folder" << std::endl;
+	std::cerr << "    -manifest file: With -r, remember what was converted in the given file, and on later runs only convert files that changed and delete outputs that are no longer produced" << std::endl;
+	std::cerr << "    -coverage: Print the nonzero regions of the input file that weren't used while decoding it" << std::endl;
+	std::cerr << "    -debug-decompress offset,length: Try decompressing from every offset in the given range of any file, writing the results to the output folder" << std::endl;
+	std::cerr << "    -decompress-size min,max: Only keep -debug-decompress results of at least min bytes, and stop decompressing at max bytes" << std::endl;
+	std::cerr << "    -decompress-image w,h: Also write -debug-decompress results as w x h indexed images" << std::endl;
 	exit(1);
 }
 
-fs::path currentFileName;
-bool SHOULD_WRITE_DEBUG_IMAGES = false;
-bool SAVE_BUP_AS_PARTS = false;
-fs::path debugImagePath;
+/// Parses `a,b` where both are unsigned numbers (decimal, or hex with 0x), returns false if that's not the whole argument
+static bool parseUnsignedPair(const char *arg, unsigned long long &a, unsigned long long &b) {
+	for (unsigned long long *out : {&a, &b}) {
+		if (!isdigit((unsigned char)*arg)) { return false; }
+		char *end;
+		errno = 0;
+		*out = strtoull(arg, &end, 0);
+		if (errno == ERANGE || end == arg) { return false; }
+		arg = end;
+		if (out == &a) {
+			if (*arg != ',') { return false; }
+			arg++;
+		}
+	}
+	return *arg == '\0';
+}
 
 #ifdef _WIN32
 #  define WIN32_LEAN_AND_MEAN
 #  include <windows.h>
 #  include <shellapi.h>
+#  include <fcntl.h>
+#  include <io.h>
 #endif
 
 int main(int argc, const char **argv) {
-	fs::path inFilename, outFilename, replace;
+	fs::path inFilename, outFilename, replace, mask, manifest, socketPath;
+	ConversionContext ctx;
+	bool printCoverage = false;
+	bool crop = false;
+	bool recursive = false;
+	bool serving = false;
+	unsigned shard = 0, shardCount = 1;
+	bool sharded = false;
+	Point cropPos = {0, 0};
+	Size cropSize = {0, 0};
+	bool scan = false;
+	unsigned long long scanOffset = 0, scanLength = 0;
+	unsigned long long scanMin = 0, scanMax = SIZE_MAX;
+	Size scanImage = {0, 0};
 #ifdef _WIN32
 	int wargc;
 	LPWSTR* wargv = CommandLineToArgvW(GetCommandLineW(), &wargc);
@@ -40,15 +100,124 @@ int main(int argc, const char **argv) {
 #endif
 	for (int i = 1; i < argc; i++) {
 		if (0 == strcmp(argv[i], "-bup-parts")) {
-			SAVE_BUP_AS_PARTS = true;
+			ctx.saveBupAsParts = true;
+		}
+		else if (0 == strcmp(argv[i], "-only")) {
+			i++;
+			if (i >= argc) {
+				usage(argc, argv);
+			}
+			// Names are matched against UTF-8, so use the narrow argument
+			std::string names = argv[i];
+			for (size_t start = 0; start <= names.size();) {
+				size_t end = std::min(names.find(',', start), names.size());
+				if (end > start) {
+					ctx.onlyNames.push_back(names.substr(start, end - start));
+				}
+				start = end + 1;
+			}
+		}
+		else if (0 == strcmp(argv[i], "-thumbnail")) {
+			i++;
+			if (i >= argc || (ctx.thumbnailSize = atoi(argv[i])) <= 0) {
+				usage(argc, argv);
+			}
+		}
+		else if (0 == strcmp(argv[i], "-stream")) {
+			ctx.streamPic = true;
+		}
+		else if (0 == strcmp(argv[i], "-stats")) {
+			ctx.printStats = true;
+		}
+		else if (0 == strcmp(argv[i], "-j")) {
+			i++;
+			if (i >= argc || 1 != sscanf(argv[i], "%d", &THREAD_COUNT) || THREAD_COUNT < 1) {
+				usage(argc, argv);
+			}
+		}
+		else if (0 == strcmp(argv[i], "-save-queue")) {
+			i++;
+			int megabytes;
+			if (i >= argc || 1 != sscanf(argv[i], "%d", &megabytes) || megabytes < 0) {
+				usage(argc, argv);
+			}
+			SAVE_QUEUE_BYTES = (size_t)megabytes << 20;
+		}
+		else if (0 == strcmp(argv[i], "-stage-threads")) {
+			i++;
+			if (i >= argc || 3 != sscanf(argv[i], "%d,%d,%d", &READ_THREADS, &DECODE_THREADS, &ENCODE_THREADS) || READ_THREADS < 0 || DECODE_THREADS < 0 || ENCODE_THREADS < 0) {
+				usage(argc, argv);
+			}
+		}
+		else if (0 == strcmp(argv[i], "-r")) {
+			recursive = true;
+		}
+		else if (0 == strcmp(argv[i], "-serve")) {
+			serving = true;
+		}
+		else if (0 == strcmp(argv[i], "-socket")) {
+			i++;
+			if (i >= argc) {
+				usage(argc, argv);
+			}
+			socketPath = arg_fnames[i];
+		}
+		else if (0 == strcmp(argv[i], "-shard")) {
+			i++;
+			if (i >= argc || 2 != sscanf(argv[i], "%u/%u", &shard, &shardCount) || shardCount == 0 || shard >= shardCount) {
+				usage(argc, argv);
+			}
+			sharded = true;
+		}
+		else if (0 == strcmp(argv[i], "-manifest")) {
+			i++;
+			if (i >= argc) {
+				usage(argc, argv);
+			}
+			manifest = arg_fnames[i];
+		}
+		else if (0 == strcmp(argv[i], "-coverage")) {
+			printCoverage = true;
 		}
 		else if (0 == strcmp(argv[i], "-debug-images")) {
 			i++;
 			if (i >= argc) {
 				usage(argc, argv);
 			}
-			debugImagePath = arg_fnames[i];
-			SHOULD_WRITE_DEBUG_IMAGES = true;
+			ctx.debugImagePath = arg_fnames[i];
+		}
+		else if (0 == strcmp(argv[i], "-mask")) {
+			i++;
+			if (i >= argc) {
+				usage(argc, argv);
+			}
+			mask = arg_fnames[i];
+		}
+		else if (0 == strcmp(argv[i], "-crop")) {
+			i++;
+			if (i >= argc || 4 != sscanf(argv[i], "%d,%d,%d,%d", &cropPos.x, &cropPos.y, &cropSize.width, &cropSize.height)) {
+				usage(argc, argv);
+			}
+			crop = true;
+		}
+		else if (0 == strcmp(argv[i], "-debug-decompress")) {
+			i++;
+			if (i >= argc || !parseUnsignedPair(argv[i], scanOffset, scanLength)) {
+				usage(argc, argv);
+			}
+			scan = true;
+		}
+		else if (0 == strcmp(argv[i], "-decompress-size")) {
+			i++;
+			if (i >= argc || !parseUnsignedPair(argv[i], scanMin, scanMax)) {
+				usage(argc, argv);
+			}
+		}
+		else if (0 == strcmp(argv[i], "-decompress-image")) {
+			i++;
+			if (i >= argc || 2 != sscanf(argv[i], "%d,%d", &scanImage.width, &scanImage.height)) {
+				usage(argc, argv);
+			}
 		}
 		else if (0 == strcmp(argv[i], "-replace")) {
 			i++;
@@ -67,47 +236,159 @@ int main(int argc, const char **argv) {
 			usage(argc, argv);
 		}
 	}
+	if (serving) {
+		if (recursive || crop || scan || printCoverage || sharded || !inFilename.empty() || !replace.empty() || !mask.empty() || !manifest.empty() || !ctx.debugImagePath.empty()) {
+			std::cerr << "-serve only takes the options that apply to every job, and no files" << std::endl;
+			return EXIT_FAILURE;
+		}
+		return serve(ctx, socketPath);
+	}
+	if (!socketPath.empty()) {
+		std::cerr << "-socket can only be used with -serve" << std::endl;
+		return EXIT_FAILURE;
+	}
 	if (inFilename.empty() || outFilename.empty()) {
 		usage(argc,argv);
 	}
-	currentFileName = inFilename;
+	if (recursive) {
+		if (crop || scan || printCoverage || !replace.empty() || !mask.empty()) {
+			std::cerr << "-r can't be combined with -crop, -mask, -replace, -coverage or -debug-decompress" << std::endl;
+			return EXIT_FAILURE;
+		}
+		if (!fs::is_directory(inFilename)) {
+			std::cerr << inFilename.string() << " is not a directory" << std::endl;
+			return EXIT_FAILURE;
+		}
+		return processDirectory(ctx, inFilename, outFilename, manifest, shard, shardCount);
+	}
+	if (!manifest.empty() || sharded) {
+		std::cerr << "-manifest and -shard can only be used with -r" << std::endl;
+		return EXIT_FAILURE;
+	}
+	// -mask and -crop decode the whole region in one go, they don't go through the thumbnail or streaming decoders
+	if ((!mask.empty() || crop) && (ctx.thumbnailSize > 0 || ctx.streamPic)) {
+		std::cerr << "-mask and -crop can't be combined with -thumbnail or -stream" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (!mask.empty() && crop) {
+		std::cerr << "-mask can't be combined with -crop" << std::endl;
+		return EXIT_FAILURE;
+	}
+	bool toStdout = isStdio(outFilename);
+	if (toStdout) {
+		if (scan || printCoverage || ctx.printStats) {
+			std::cerr << "-debug-decompress, -coverage and -stats can't be used when writing to stdout" << std::endl;
+			return EXIT_FAILURE;
+		}
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		ctx.outputStream = &std::cout;
+	}
+	ctx.fileName = isStdio(inFilename) ? fs::path("stdin") : inFilename;
 
-	std::ifstream in(argv[1], std::ios::binary);
-	if (!in) {
-		std::cerr << "Failed to open file " << argv[1] << std::endl;
+	std::unique_ptr<MappedFile> file;
+	try {
+		if (isStdio(inFilename)) {
+			file = std::make_unique<MappedFile>(MappedFile::readStdin());
+		} else {
+			file = std::make_unique<MappedFile>(inFilename);
+		}
+	} catch (std::runtime_error &e) {
+		std::cerr << e.what() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	ByteSpan in = file->data();
+	if (in.size() < 4) {
+		std::cerr << ctx.fileName.string() << ": file is too small to have a magic number" << std::endl;
 		exit(EXIT_FAILURE);
 	}
 
 	boost::endian::big_int32_buf_t magic;
-	
-	in.read((char *)&magic, 4);
-	in.seekg(0, in.beg);
-
-	if (!replace.empty()) {
-		fs::ofstream outfile(outFilename, std::ios::binary);
-		switch (magic.value()) {
-			case 'PIC4': return replacePic(in, outfile, replace);
-			case 'TXA4': return replaceTxa(in, outfile, replace);
-		}
-		char *chars = (char *)&magic;
-		std::cerr << argv[1] << ": file type '" << chars[0] << chars[1] << chars[2] << chars[3] << "' unsupported by replace" << std::endl;
+	memcpy(&magic, in.data(), 4);
+	if (toStdout && replace.empty() && magic.value() != 'PIC4' && magic.value() != 'MSK3' && magic.value() != 'MSK4') {
+		std::cerr << ctx.fileName.string() << ": only pic and msk files can be written to stdout, other types can produce several images" << std::endl;
 		return EXIT_FAILURE;
-	} else {
-		int (*processFunction)(std::istream&, const fs::path&);
-		switch (magic.value()) {
-			case 'PIC4': processFunction = processPic; break;
-			case 'BUP4': processFunction = processBup; break;
-			case 'TXA4': processFunction = processTxa; break;
-			case 'MSK3': processFunction = processMsk3; break;
-			case 'MSK4': processFunction = processMsk4; break;
-			default: {
+	}
+
+	auto convert = [&]() -> int {
+		if (scan) {
+			fs::create_directories(outFilename);
+			if (scanOffset > in.size() || scanLength > in.size() - scanOffset) {
+				std::cerr << ctx.fileName.string() << ": range to decompress is outside of the " << in.size() << " byte file" << std::endl;
+				return EXIT_FAILURE;
+			}
+			bool isSwitch = detectSwitch(SpanReader(ctx, in)) >= 0;
+			return debugDecompress(ctx, in, scanOffset, scanLength, isSwitch, outFilename, scanMin, scanMax, scanImage);
+		} else if (!replace.empty()) {
+			if (toStdout) {
+				// Replacing seeks around the output, which stdout may not support
+				std::stringstream out(std::ios::in | std::ios::out | std::ios::binary);
+				int res;
+				switch (magic.value()) {
+					case 'PIC4': res = replacePic(ctx, in, out, replace); break;
+					case 'TXA4': res = replaceTxa(ctx, in, out, replace); break;
+					default: res = -1;
+				}
+				if (res >= 0) {
+					std::cout << out.rdbuf() << std::flush;
+					return res;
+				}
+			} else {
+				fs::ofstream outfile(outFilename, std::ios::binary);
+				switch (magic.value()) {
+					case 'PIC4': return replacePic(ctx, in, outfile, replace);
+					case 'TXA4': return replaceTxa(ctx, in, outfile, replace);
+				}
+			}
+			char *chars = (char *)&magic;
+			std::cerr << ctx.fileName.string() << ": file type '" << chars[0] << chars[1] << chars[2] << chars[3] << "' unsupported by replace" << std::endl;
+			return EXIT_FAILURE;
+		} else if (!mask.empty()) {
+			switch (magic.value()) {
+				case 'PIC4': return processPicWithMask(ctx, in, outFilename, mask);
+			}
+			char *chars = (char *)&magic;
+			std::cerr << ctx.fileName.string() << ": file type '" << chars[0] << chars[1] << chars[2] << chars[3] << "' unsupported by mask" << std::endl;
+			return EXIT_FAILURE;
+		} else if (crop) {
+			switch (magic.value()) {
+				case 'PIC4': return processPicRegion(ctx, in, outFilename, cropPos, cropSize);
+			}
+			char *chars = (char *)&magic;
+			std::cerr << ctx.fileName.string() << ": file type '" << chars[0] << chars[1] << chars[2] << chars[3] << "' unsupported by crop" << std::endl;
+			return EXIT_FAILURE;
+		} else {
+			ProcessFunction processFunction = processFunctionFor(magic.value());
+			if (!processFunction) {
 				char *chars = (char *)&magic;
-				std::cerr << argv[1] << ": unknown magic: '" << chars[0] << chars[1] << chars[2] << chars[3] << "'" << std::endl;
+				std::cerr << ctx.fileName.string() << ": unknown magic: '" << chars[0] << chars[1] << chars[2] << chars[3] << "'" << std::endl;
 				exit(EXIT_FAILURE);
 			}
+			return processFunction(ctx, in, outFilename);
 		}
-		return processFunction(in, argv[2]);
+	};
+
+	RegionChecker checker(in);
+	if (printCoverage) {
+		ctx.coverage = &checker;
+	}
+	int result;
+	try {
+		result = convert();
+	} catch (std::exception &e) {
+		std::cerr << ctx.fileName.string() << ": " << e.what() << std::endl;
+		result = EXIT_FAILURE;
+	}
+#if ENABLE_MULTITHREADED
+	if (ThreadedImageSaver::shared().wait(ctx.printStats) > 0 && result == 0) {
+		result = EXIT_FAILURE;
+	}
+#endif
+	if (printCoverage) {
+		checker.printRegions(inFilename);
 	}
+	return result;
 }
 
 
@@ -0,0 +1,68 @@
+import json
+import socket
+import subprocess
+import sys
+from pathlib import Path
+
+# Sends conversion jobs to `EnterExtractor -serve` and prints the completion records as they arrive
+# Either starts its own server, or connects to one already listening with `-socket path`
+
+def jobs_for(paths, dst_folder, options):
+	for i, path in enumerate(paths):
+		job = dict(options)
+		job['id'] = i
+		job['input'] = str(path)
+		job['output'] = str(Path(dst_folder) / (Path(path).name + '.png'))
+		yield job
+
+def run_with_server(jobs):
+	server = subprocess.Popen(['EnterExtractor', '-serve'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True)
+	for job in jobs:
+		server.stdin.write(json.dumps(job) + '\n')
+	server.stdin.close()
+	for line in server.stdout:
+		yield json.loads(line)
+	server.wait()
+
+def run_with_socket(socket_path, jobs):
+	with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+		sock.connect(socket_path)
+		sock.sendall(''.join(json.dumps(job) + '\n' for job in jobs).encode('utf-8'))
+		# The server finishes the remaining jobs and closes the connection once we stop sending
+		sock.shutdown(socket.SHUT_WR)
+		with sock.makefile('r', encoding='utf-8') as records:
+			for line in records:
+				yield json.loads(line)
+
+def main(args):
+	socket_path = None
+	options = {}
+	while args and args[0].startswith('--'):
+		flag = args.pop(0)
+		if flag == '--socket':
+			socket_path = args.pop(0)
+		elif flag == '--thumbnail':
+			options['thumbnail'] = int(args.pop(0))
+		elif flag == '--only':
+			options['only'] = args.pop(0)
+		else:
+			raise SystemExit(f"Unknown option {flag}")
+	if len(args) < 2:
+		print("Usage: python enter_extractor_client.py [--socket path] [--thumbnail N] [--only names] dst_folder file...")
+		raise SystemExit(-1)
+
+	dst_folder, paths = args[0], args[1:]
+	jobs = list(jobs_for(paths, dst_folder, options))
+	records = run_with_socket(socket_path, jobs) if socket_path else run_with_server(jobs)
+	failed = 0
+	for record in records:
+		path = paths[record['id']]
+		if record['ok']:
+			print(f"{path}: {len(record['outputs'])} outputs in {record['ms']}ms")
+		else:
+			failed += 1
+			print(f"{path}: FAILED: {record['error']}")
+	raise SystemExit(1 if failed else 0)
+
+if __name__ == '__main__':
+	main(sys.argv[1:])